@@ -0,0 +1,341 @@
+#include "BlockCache.hpp"
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+
+extern bool g_DebugMode;
+
+BlockCache::BlockCache(size_t cacheSize, size_t blockSize) :
+	m_blockSize(blockSize),
+	m_blocks(std::max<size_t>(cacheSize / blockSize, 2)),
+	m_hand(0),
+	m_ahead(0),
+	m_aheadEnd(0),
+	m_size(-1),
+	m_error(0),
+	m_hits(0),
+	m_missCount(0)
+{
+	/** Readahead may use half of the cache, rest is left for
+	 *  blocks of random accesses.
+	**/
+	m_window = m_blocks.size() / 2;
+
+	m_data = new char[m_blocks.size() * m_blockSize];
+
+	for (size_t i = 0; i < m_blocks.size(); i++)
+	{
+		m_blocks[i].index = -1;
+		m_blocks[i].state = Block::Empty;
+		m_blocks[i].len = 0;
+		m_blocks[i].referenced = false;
+		m_blocks[i].error = 0;
+		m_blocks[i].data = m_data + i * m_blockSize;
+	}
+
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_wakeupReader, NULL);
+	pthread_cond_init(&m_wakeupThread, NULL);
+}
+
+BlockCache::~BlockCache()
+{
+	pthread_cond_destroy(&m_wakeupThread);
+	pthread_cond_destroy(&m_wakeupReader);
+	pthread_mutex_destroy(&m_mutex);
+
+	delete[] m_data;
+}
+
+void BlockCache::setSize(off_t size)
+{
+	pthread_mutex_lock(&m_mutex);
+	m_size = size;
+	pthread_cond_broadcast(&m_wakeupReader);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void BlockCache::interrupt(int error)
+{
+	pthread_mutex_lock(&m_mutex);
+	m_error = error;
+	pthread_cond_broadcast(&m_wakeupReader);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+ssize_t BlockCache::read(char *buf, size_t len, off_t offset)
+{
+	size_t copied = 0;
+
+	pthread_mutex_lock(&m_mutex);
+
+	while ((m_size == -1) && (m_error == 0))
+		pthread_cond_wait(&m_wakeupReader, &m_mutex);
+
+	if (offset < m_size)
+		len = std::min<off_t>(len, m_size - offset);
+	else
+		len = 0;
+
+	while ((copied < len) && (m_error == 0))
+	{
+		off_t pos = offset + copied;
+		off_t index = pos / m_blockSize;
+
+		std::map<off_t, Block *>::iterator it = m_index.find(index);
+		Block *block = (it != m_index.end()) ? it->second : NULL;
+
+		if ((block != NULL) && (block->state == Block::Valid))
+		{
+			/** Hit, copy data from the block.
+			**/
+			size_t start = pos - index * m_blockSize;
+			if (start >= block->len)
+				break;
+
+			size_t n = std::min(len - copied, block->len - start);
+			memcpy(buf + copied, block->data + start, n);
+			copied += n;
+
+			block->referenced = true;
+			m_hits++;
+
+			/** Sequential reader reached blocks fetched in advance,
+			 *  keep readahead running in front of it.
+			**/
+			if ((index >= m_aheadEnd - m_window) && (index < m_aheadEnd))
+				m_aheadEnd = index + 1 + m_window;
+		}
+		else if ((block != NULL) && (block->state == Block::Empty))
+		{
+			/** Fetching of the block failed, release it and report
+			 *  the error.
+			**/
+			int error = block->error;
+			m_index.erase(it);
+			block->index = -1;
+			block->error = 0;
+
+			pthread_cond_signal(&m_wakeupThread);
+			pthread_mutex_unlock(&m_mutex);
+			return (copied > 0) ? static_cast<ssize_t>(copied) : -error;
+		}
+		else
+		{
+			if (block == NULL)
+			{
+				/** Miss, ask thread to fetch the block and blocks
+				 *  following it.
+				**/
+				if (std::find(m_misses.begin(), m_misses.end(), index) == m_misses.end())
+				{
+					m_misses.push_back(index);
+					m_missCount++;
+				}
+				m_ahead = index + 1;
+				m_aheadEnd = index + 1 + m_window;
+
+				pthread_cond_signal(&m_wakeupThread);
+			}
+
+			/** Wait until the block is filled.
+			**/
+			m_waiting[index]++;
+			pthread_cond_wait(&m_wakeupReader, &m_mutex);
+			if (--m_waiting[index] == 0)
+				m_waiting.erase(index);
+		}
+	}
+
+	int error = m_error;
+
+	pthread_mutex_unlock(&m_mutex);
+
+	if ((copied == 0) && (error != 0))
+		return -error;
+
+	return copied;
+}
+
+BlockCache::Block *BlockCache::next()
+{
+	Block *block = NULL;
+
+	pthread_mutex_lock(&m_mutex);
+
+	while (block == NULL)
+	{
+		off_t blocks = (m_size + m_blockSize - 1) / m_blockSize;
+
+		if (!m_misses.empty())
+		{
+			/** Blocks readers wait for go first.
+			**/
+			off_t index = m_misses.front();
+
+			if (m_index.find(index) != m_index.end())
+			{
+				m_misses.pop_front();
+				continue;
+			}
+
+			block = fill(index);
+			if (block != NULL)
+				m_misses.pop_front();
+		}
+		else if ((m_ahead < m_aheadEnd) && (m_ahead < blocks))
+		{
+			/** Readahead after the most recent miss.
+			**/
+			if (m_index.find(m_ahead) != m_index.end())
+			{
+				m_ahead++;
+				continue;
+			}
+
+			block = fill(m_ahead);
+			if (block != NULL)
+				m_ahead++;
+		}
+
+		/** Wait for a miss (or for a block to become evictable).
+		**/
+		if (block == NULL)
+			pthread_cond_wait(&m_wakeupThread, &m_mutex);
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << ", block: " << block->index << std::endl;
+
+	return block;
+}
+
+BlockCache::Block *BlockCache::nextMiss()
+{
+	Block *block = NULL;
+
+	pthread_mutex_lock(&m_mutex);
+
+	while ((block == NULL) && !m_misses.empty())
+	{
+		off_t index = m_misses.front();
+
+		if (m_index.find(index) == m_index.end())
+		{
+			/** All blocks are busy.
+			**/
+			block = fill(index);
+			if (block == NULL)
+				break;
+		}
+		m_misses.pop_front();
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+
+	if (g_DebugMode && (block != NULL))
+		std::cout << __PRETTY_FUNCTION__ << ", block: " << block->index << std::endl;
+
+	return block;
+}
+
+void BlockCache::filled(Block *block, ssize_t r, int error)
+{
+	pthread_mutex_lock(&m_mutex);
+
+	assert(block->state == Block::Filling);
+
+	if (r == -1)
+	{
+		block->state = Block::Empty;
+		block->error = error;
+		block->len = 0;
+
+		/** Nobody waits for the error (failed readahead), release
+		 *  the block so failed blocks don't fill the cache.
+		**/
+		if (m_waiting.find(block->index) == m_waiting.end())
+		{
+			m_index.erase(block->index);
+			block->index = -1;
+			block->error = 0;
+		}
+	}
+	else
+	{
+		block->state = Block::Valid;
+		block->len = r;
+	}
+
+	pthread_cond_broadcast(&m_wakeupReader);
+	pthread_cond_signal(&m_wakeupThread);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+BlockCache::Block *BlockCache::fill(off_t index)
+{
+	Block *block = evict();
+	if (block == NULL)
+		return NULL;
+
+	block->index = index;
+	block->state = Block::Filling;
+	block->len = 0;
+	block->error = 0;
+	block->referenced = true;
+	m_index[index] = block;
+
+	return block;
+}
+
+BlockCache::Block *BlockCache::evict()
+{
+	/** Two rounds are enough to clear all reference bits.
+	**/
+	for (size_t i = 0; i < 2 * m_blocks.size(); i++)
+	{
+		Block *block = &m_blocks[m_hand];
+		m_hand = (m_hand + 1) % m_blocks.size();
+
+		if (block->state == Block::Filling)
+			continue;
+
+		/** Failed block that has not been reported yet.
+		**/
+		if ((block->state == Block::Empty) && (block->index != -1))
+			continue;
+
+		if (block->referenced)
+		{
+			block->referenced = false;
+			continue;
+		}
+
+		if (block->index != -1)
+			m_index.erase(block->index);
+
+		block->index = -1;
+		block->state = Block::Empty;
+		return block;
+	}
+	return NULL;
+}
+
+int BlockCache::stat(char *buf, size_t len)
+{
+	/** Ignore locking, this is only for statistical purpose.
+	 *  Reader may ask for less than the whole line.
+	**/
+	char line[128];
+	int r = snprintf(line, sizeof(line), "BLOCKS: %zu, USED: %zu, HITS: %lu, MISSES: %lu\n",
+	                 m_blocks.size(), m_index.size(), m_hits, m_missCount);
+	r = std::min<size_t>(std::min<size_t>(r, sizeof(line) - 1), len);
+	memcpy(buf, line, r);
+	return r;
+}
@@ -0,0 +1,178 @@
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <map>
+#include <deque>
+#include <vector>
+
+/** Cache of fixed-size blocks of a file keyed by file offset. Suitable
+ *  for random access, unlike circular buffer it keeps data for many
+ *  different offsets. Blocks are evicted by CLOCK algorithm.
+ *
+ *  Readers use read(), a single thread fetches blocks returned by
+ *  next() and hands them back by filled(). Blocks requested by readers
+ *  (misses) are fetched first, then blocks following the most recent
+ *  miss (readahead).
+**/
+class BlockCache
+{
+public:
+	/** Block of the cache.
+	**/
+	struct Block
+	{
+		enum State
+		{
+			/** Block holds no data.
+			**/
+			Empty,
+
+			/** Block is being fetched by thread.
+			**/
+			Filling,
+
+			/** Block holds data.
+			**/
+			Valid
+		};
+
+		/** Index of the block in the file (offset / block size).
+		**/
+		off_t    index;
+
+		State    state;
+
+		/** Number of valid bytes, smaller than block size only
+		 *  for the last block of the file.
+		**/
+		size_t   len;
+
+		/** Reference bit for CLOCK eviction.
+		**/
+		bool     referenced;
+
+		/** Error code if fetching failed, block is Empty then.
+		**/
+		int      error;
+
+		/** Pointer to block's data.
+		**/
+		char    *data;
+	};
+
+	/** Constructor.
+	 *  @param cacheSize size of the cache in bytes
+	 *  @param blockSize size of one block in bytes
+	**/
+	BlockCache(size_t cacheSize, size_t blockSize);
+	~BlockCache();
+
+	/** Set size of cached file. Readers wait until it is set.
+	**/
+	void setSize(off_t size);
+
+	/** Read data from the cache, wait for missing blocks.
+	 *  @return size of read data, 0 at end of file or -errno
+	**/
+	ssize_t read(char *buf, size_t len, off_t offset);
+
+	/** Fail all current and future reads with error.
+	**/
+	void interrupt(int error);
+
+	/** Used by thread. Wait until there is a block to fetch.
+	 *  @return block in Filling state
+	**/
+	Block *next();
+
+	/** Used by thread. Take another block readers wait for
+	 *  without waiting, so that it is fetched together with
+	 *  the block returned by next().
+	 *  @return block in Filling state or NULL if there is none
+	**/
+	Block *nextMiss();
+
+	/** Used by thread. Store result of fetching block's data.
+	 *  @param block block returned by next()
+	 *  @param r number of bytes fetched or -1
+	 *  @param error errno if r is -1
+	**/
+	void filled(Block *block, ssize_t r, int error);
+
+	size_t blockSize() const { return m_blockSize; }
+
+	/** Print statistics.
+	**/
+	int stat(char *buf, size_t len);
+
+private:
+	/** Find a block to be reused.
+	 *  @return block removed from index or NULL if all blocks are busy
+	**/
+	Block *evict();
+
+	/** Take a free block for index and mark it Filling.
+	**/
+	Block *fill(off_t index);
+
+	const size_t m_blockSize;
+
+	std::vector<Block> m_blocks;
+
+	/** Memory of all blocks.
+	**/
+	char *m_data;
+
+	/** Blocks that hold data (or are being filled) by index.
+	**/
+	std::map<off_t, Block *> m_index;
+
+	/** CLOCK hand.
+	**/
+	size_t m_hand;
+
+	/** Block indexes readers wait for.
+	**/
+	std::deque<off_t> m_misses;
+
+	/** Number of readers waiting for a block by its index. Failed
+	 *  blocks nobody waits for are released at once.
+	**/
+	std::map<off_t, size_t> m_waiting;
+
+	/** Readahead range [m_ahead, m_aheadEnd) following the most
+	 *  recent miss.
+	**/
+	off_t m_ahead;
+	off_t m_aheadEnd;
+
+	/** Number of blocks fetched in advance after a miss.
+	**/
+	off_t m_window;
+
+	/** Size of cached file, -1 if not known yet.
+	**/
+	off_t m_size;
+
+	/** Error code readers fail with, 0 if none.
+	**/
+	int m_error;
+
+	unsigned long m_hits;
+	unsigned long m_missCount;
+
+	pthread_mutex_t m_mutex;
+
+	/** Signals readers that a block has been filled.
+	**/
+	pthread_cond_t  m_wakeupReader;
+
+	/** Signals thread that there is a new miss or a block
+	 *  has become evictable.
+	**/
+	pthread_cond_t  m_wakeupThread;
+};
+
+#endif
@@ -3,12 +3,21 @@
 #include <algorithm>
 #include <iostream>
 #include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-CBuffer::CBuffer(int bufferSize) :
+CBuffer::CBuffer(size_t bufferSize) :
 	m_readP(0),
+	m_tailP(0),
+	m_lookBehind(0),
+	m_lowWatermark(bufferSize),
 	m_writeP(0),
-	m_full(false),
-	m_empty(true),
+	m_dataEvent(0),
+	m_spaceEvent(0),
+	m_readerWaiting(0),
+	m_writerWaiting(0),
 	m_bufferSize(bufferSize)
 {
 }
@@ -16,33 +25,40 @@ CBuffer::CBuffer(int bufferSize) :
 void CBuffer::clear()
 {
 	m_readP = 0;
+	m_tailP = 0;
 	m_writeP = 0;
-	m_full = false;
-	m_empty = true;
 }
 
-int CBuffer::free() const
+uint64_t CBuffer::readPosition() const
 {
-	int free;
-	if (m_full)
-		free = 0;
-	else if (m_empty)
-		free = m_bufferSize;
-	else if (m_readP < m_writeP)
-		free = m_bufferSize - m_writeP + m_readP;
-	else
-		free = m_readP - m_writeP;
-	return free;
+	return __atomic_load_n(&m_readP, __ATOMIC_ACQUIRE);
 }
 
-int CBuffer::full() const
+uint64_t CBuffer::writePosition() const
 {
-	int full;
-	full = m_bufferSize - free();
-	return full;
+	return __atomic_load_n(&m_writeP, __ATOMIC_ACQUIRE);
 }
 
-int CBuffer::get(char *buf, int len)
+size_t CBuffer::free() const
+{
+	/** Data in look-behind window are not free.
+	**/
+	uint64_t tailP = __atomic_load_n(&m_tailP, __ATOMIC_ACQUIRE);
+	uint64_t writeP = writePosition();
+	return m_bufferSize - (writeP - tailP);
+}
+
+size_t CBuffer::full() const
+{
+	/** Load read pointer first, write pointer can only move
+	 *  forward meanwhile so the result is never negative.
+	**/
+	uint64_t readP = readPosition();
+	uint64_t writeP = writePosition();
+	return writeP - readP;
+}
+
+ssize_t CBuffer::get(char *buf, size_t len)
 {
 	char *orig_buf = buf;
 
@@ -50,7 +66,9 @@ int CBuffer::get(char *buf, int len)
 
 	while (len > 0)
 	{
-		int r = read(m_readP, buf, std::min(len, m_bufferSize - m_readP));
+		size_t pos = m_readP % m_bufferSize;
+		size_t n = isMirrored() ? len : std::min(len, m_bufferSize - pos);
+		ssize_t r = read(pos, buf, n);
 		if (r == -1)
  			return -1;
 		else if (r == 0)
@@ -59,29 +77,152 @@ int CBuffer::get(char *buf, int len)
 		buf += r;
 		len -= r;
 
-		m_readP += r;
-		if (m_readP >= m_bufferSize)
-			m_readP -= m_bufferSize;
-		if (m_readP == m_writeP)
-			m_empty = true;
-		m_full = false;
+		advance(r);
 	}
 	return buf - orig_buf;
 }
 
-void CBuffer::advance(int offset)
+void CBuffer::advance(size_t offset)
+{
+	assert(offset <= full());
+
+	if (offset == 0)
+		return;
+
+	__atomic_store_n(&m_readP, m_readP + offset, __ATOMIC_RELEASE);
+
+	/** Release space of data that are out of look-behind window,
+	 *  writer is told only below the low watermark.
+	**/
+	if (m_readP - m_tailP > m_lookBehind)
+	{
+		__atomic_store_n(&m_tailP, m_readP - m_lookBehind, __ATOMIC_RELEASE);
+		if (full() < m_lowWatermark)
+			wake(&m_spaceEvent, &m_writerWaiting);
+	}
+}
+
+void CBuffer::drop(size_t offset)
 {
 	assert(offset <= full());
 
-	m_readP += offset;
-	if (m_readP >= m_bufferSize)
-		m_readP -= m_bufferSize;
-	if (m_readP == m_writeP)
-		m_empty = true;
-	m_full = false;
+	__atomic_store_n(&m_readP, m_readP + offset, __ATOMIC_RELEASE);
+	__atomic_store_n(&m_tailP, m_readP, __ATOMIC_RELEASE);
+	wake(&m_spaceEvent, &m_writerWaiting);
+}
+
+void CBuffer::setLookBehind(size_t len)
+{
+	m_lookBehind = std::min(len, m_bufferSize / 2);
+}
+
+size_t CBuffer::lookBehind() const
+{
+	return m_lookBehind;
+}
+
+void CBuffer::setLowWatermark(size_t len)
+{
+	m_lowWatermark = std::min(len, m_bufferSize);
+}
+
+size_t CBuffer::lowWatermark() const
+{
+	return m_lowWatermark;
+}
+
+size_t CBuffer::behind() const
+{
+	return m_readP - m_tailP;
+}
+
+void CBuffer::rewind(size_t offset)
+{
+	assert(offset <= behind());
+
+	__atomic_store_n(&m_readP, m_readP - offset, __ATOMIC_RELEASE);
+}
+
+int CBuffer::readSpans(CSpan span[2], size_t len) const
+{
+	int n = 0;
+	size_t pos = m_readP % m_bufferSize;
+
+	len = std::min(len, full());
+
+	if (len > 0)
+	{
+		span[n].pos = pos;
+		span[n].len = std::min(len, m_bufferSize - pos);
+		len -= span[n].len;
+		n++;
+	}
+	if (len > 0)
+	{
+		span[n].pos = 0;
+		span[n].len = len;
+		n++;
+	}
+	return n;
 }
 
-int CBuffer::put(char *buf, int len)
+int CBuffer::writeSpans(CSpan span[2], size_t len, size_t skip) const
+{
+	int n = 0;
+	size_t pos = (m_writeP + skip) % m_bufferSize;
+	size_t space = free();
+
+	len = std::min(len, (space > skip) ? space - skip : 0);
+
+	if (len > 0)
+	{
+		span[n].pos = pos;
+		span[n].len = std::min(len, m_bufferSize - pos);
+		len -= span[n].len;
+		n++;
+	}
+	if (len > 0)
+	{
+		span[n].pos = 0;
+		span[n].len = len;
+		n++;
+	}
+	return n;
+}
+
+int CBuffer::writeVector(struct iovec iov[2], size_t len, size_t skip) const
+{
+	CSpan span[2];
+	int n = writeSpans(span, len, skip);
+
+	/** Second region directly follows the first one in memory.
+	**/
+	if ((n == 2) && isMirrored())
+	{
+		span[0].len += span[1].len;
+		n = 1;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		iov[i].iov_base = address(span[i].pos);
+		iov[i].iov_len = span[i].len;
+	}
+	return n;
+}
+
+void CBuffer::commit(size_t len)
+{
+	assert(len <= free());
+
+	if (len == 0)
+		return;
+
+	__atomic_store_n(&m_writeP, m_writeP + len, __ATOMIC_RELEASE);
+	wake(&m_dataEvent, &m_readerWaiting);
+}
+
+ssize_t CBuffer::put(char *buf, size_t len)
 {
 	char *orig_buf = buf;
 
@@ -89,7 +230,9 @@ int CBuffer::put(char *buf, int len)
 
 	while (len > 0)
 	{
-		int r = write(m_writeP, buf, std::min(len, m_bufferSize - m_writeP));
+		size_t pos = m_writeP % m_bufferSize;
+		size_t n = isMirrored() ? len : std::min(len, m_bufferSize - pos);
+		ssize_t r = write(pos, buf, n);
 		if (r == -1)
 			return -1;
 		else if (r == 0)
@@ -98,28 +241,79 @@ int CBuffer::put(char *buf, int len)
 		buf += r;
 		len -= r;
 
-		m_writeP += r;
-		if (m_writeP >= m_bufferSize)
-			m_writeP -= m_bufferSize;
-		if (m_readP == m_writeP)
-			m_full = true;
-		m_empty = false;
+		commit(r);
 	}
 	return buf - orig_buf;
 }
 
 bool CBuffer::isFree() const
 {
-	return m_empty;
+	return full() == 0;
 }
 
 bool CBuffer::isFull() const
 {
-	return m_full;
+	return free() == 0;
 }
 
-int CBuffer::size() const
+size_t CBuffer::size() const
 {
 	return m_bufferSize;
 }
 
+int CBuffer::dataEvent() const
+{
+	return __atomic_load_n(&m_dataEvent, __ATOMIC_ACQUIRE);
+}
+
+void CBuffer::waitData(int event)
+{
+	wait(&m_dataEvent, event, &m_readerWaiting);
+}
+
+void CBuffer::wakeReader()
+{
+	wake(&m_dataEvent, &m_readerWaiting);
+}
+
+int CBuffer::spaceEvent() const
+{
+	return __atomic_load_n(&m_spaceEvent, __ATOMIC_ACQUIRE);
+}
+
+void CBuffer::waitSpace(int event)
+{
+	wait(&m_spaceEvent, event, &m_writerWaiting);
+}
+
+void CBuffer::wakeWriter()
+{
+	wake(&m_spaceEvent, &m_writerWaiting);
+}
+
+void CBuffer::wake(int *event, int *waiting)
+{
+	/** Event is incremented always, waiting thread compares it
+	 *  with the value it has seen before going to sleep.
+	**/
+	__atomic_add_fetch(event, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) != 0)
+		::syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void CBuffer::wait(int *event, int value, int *waiting)
+{
+	__atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+
+	/** Kernel returns immediately if the event has changed since
+	 *  the value has been taken.
+	**/
+	while (__atomic_load_n(event, __ATOMIC_SEQ_CST) == value)
+	{
+		if ((::syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0) == -1) &&
+		    (errno != EAGAIN) && (errno != EINTR))
+			break;
+	}
+
+	__atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+}
@@ -2,11 +2,35 @@
  *  reading/writting data from/to storage must be implemented
  *  by class that inherits from this one.
  *
+ *  Buffer is lock-free for a single reader and a single writer
+ *  thread. Reader uses get(), advance() and readSpans(), writer
+ *  uses put(), commit() and writeSpans(). Both threads may block
+ *  in waitData() / waitSpace() when the buffer is empty / full.
+ *
  *  License: GPLv2
  *  (c) Milan Svoboda, 2008
 **/
 
+#ifndef CBUFFER_HPP
+#define CBUFFER_HPP
+
 #include <ostream>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** Contiguous region of the circular buffer's back storage.
+**/
+struct CSpan
+{
+	/** Position within the back storage
+	**/
+	size_t pos;
+
+	/** Length of the region in bytes
+	**/
+	size_t len;
+};
 
 class CBuffer
 {
@@ -14,44 +38,173 @@ public:
 	/** Constructor
 	 *  @param bufferSize
 	**/
-	CBuffer(int bufferSize);
+	CBuffer(size_t bufferSize);
 	virtual ~CBuffer() { };
 
 	/** Clear the buffer, set write and read pointer to
 	 *  the begining. Buffer is empty and not full.
+	 *  Must not be called while reader or writer use the buffer.
 	**/
 	void clear();
 
 	/** Append data to the buffer.
 	 *  @return size of data appended to the buffer in bytes
 	 **/
-	int put(char *buf, int len);
+	ssize_t put(char *buf, size_t len);
 
 	/** Get data from the buffer.
 	 *  @return size of data read from the buffer in bytes
 	 **/
-	int get(char *buf, int len);
+	ssize_t get(char *buf, size_t len);
 
 	/** Return size of free buffer space in bytes.
 	 *  @return size of free buffer space in bytes
 	 **/
-	int free() const;
+	size_t free() const;
 
 	bool isFree() const;
 
 	/** Return size of occupied buffer space in bytes.
 	 *  @return size of occupied buffer space in bytes
 	**/
-	int full() const;
+	size_t full() const;
 
 	bool isFull() const;
 
 	/** Return size of buffer in bytes.
 	 *  @return size of buffer in bytes
 	 **/
-	int size() const;
+	size_t size() const;
+
+	void advance(size_t offset);
+
+	/** Consume data like advance() but do not keep them in the
+	 *  look-behind window and forget data that are there.
+	**/
+	void drop(size_t offset);
+
+	/** Set size of look-behind window. Up to len bytes of already
+	 *  consumed data are kept in the buffer (they are not
+	 *  overwritten by writer) so reader can return to them.
+	 *  Window is limited to half of the buffer.
+	 *  @param len size of the window in bytes
+	**/
+	void setLookBehind(size_t len);
+
+	/** Return size of look-behind window in bytes.
+	**/
+	size_t lookBehind() const;
+
+	/** Return size of data kept in the look-behind window.
+	 *  @return size of consumed data available for rewind()
+	**/
+	size_t behind() const;
+
+	/** Set low watermark. Writer blocked in waitSpace() is woken
+	 *  up by consumed data only when data in the buffer drop below
+	 *  it, so it refills the buffer in batches. Default is size of
+	 *  the buffer (any consumed data wake it up).
+	 *  @param len low watermark in bytes
+	**/
+	void setLowWatermark(size_t len);
+
+	/** Return low watermark in bytes.
+	**/
+	size_t lowWatermark() const;
+
+	/** Move read pointer back to data in the look-behind window.
+	 *  @param offset number of bytes, must not exceed behind()
+	**/
+	void rewind(size_t offset);
+
+	/** Describe data available in the buffer as at most two
+	 *  regions of the back storage, the second one is used
+	 *  only when data wrap around the end of the buffer.
+	 *  Read pointer is not moved, use advance() when data
+	 *  has been consumed.
+	 *  @param span array of two regions
+	 *  @param len maximum number of bytes to describe
+	 *  @return number of regions filled
+	**/
+	int readSpans(CSpan span[2], size_t len) const;
+
+	/** Describe free space of the buffer as at most two regions
+	 *  of the back storage. Data may be written directly to them
+	 *  (see address()) and appended to the buffer by commit().
+	 *  @param span array of two regions
+	 *  @param len maximum number of bytes to describe
+	 *  @param skip number of bytes of free space to skip, regions
+	 *  start this far from the write pointer
+	 *  @return number of regions filled
+	**/
+	int writeSpans(CSpan span[2], size_t len, size_t skip = 0) const;
+
+	/** Append data written directly to the regions returned
+	 *  by writeSpans() to the buffer.
+	 *  @param len size of data written in bytes
+	**/
+	void commit(size_t len);
+
+	/** Describe free space of the buffer as memory regions
+	 *  (see address()) ready to be used by readv(2) like calls.
+	 *  Storage mapped twice in memory gives a single region.
+	 *  @param iov array of two regions
+	 *  @param len maximum number of bytes to describe
+	 *  @param skip see writeSpans()
+	 *  @return number of regions filled
+	**/
+	int writeVector(struct iovec iov[2], size_t len, size_t skip = 0) const;
+
+	/** Return total number of bytes ever read from / written to
+	 *  the buffer. Difference of two write positions is amount
+	 *  of data appended in between.
+	**/
+	uint64_t readPosition() const;
+	uint64_t writePosition() const;
+
+	/** Return event counter for waitData(). Take it before
+	 *  checking the condition to wait for to not miss a wake-up.
+	**/
+	int dataEvent() const;
+
+	/** Block reader until data are appended or wakeReader()
+	 *  is called after the event was taken by dataEvent().
+	**/
+	void waitData(int event);
+
+	/** Wake-up reader blocked in waitData().
+	**/
+	void wakeReader();
+
+	/** Return event counter for waitSpace().
+	**/
+	int spaceEvent() const;
+
+	/** Block writer until data are consumed or wakeWriter()
+	 *  is called after the event was taken by spaceEvent().
+	**/
+	void waitSpace(int event);
+
+	/** Wake-up writer blocked in waitSpace().
+	**/
+	void wakeWriter();
 
-	void advance(int offset);
+	/** Return file descriptor of the back storage.
+	 *  @return file descriptor or -1 if storage has none
+	**/
+	virtual int fd() const { return -1; }
+
+	/** Return memory address of the back storage.
+	 *  @param pos position
+	 *  @return address or NULL if storage is not in memory
+	**/
+	virtual char *address(size_t pos) const { return NULL; }
+
+	/** Return true if the back storage is mapped in memory twice
+	 *  back-to-back, so address(pos) is valid for up to size()
+	 *  bytes regardless of pos.
+	**/
+	virtual bool isMirrored() const { return false; }
 
 private:
 	/** Really read data from backed storage (may be memory,
@@ -62,7 +215,7 @@ private:
 	 *  @param len length of required data
 	 *  @return size of read data
 	**/
-	virtual int read(int pos, char *buf, int len) = 0;
+	virtual ssize_t read(size_t pos, char *buf, size_t len) = 0;
 
 	/** Really write data to backed storage (may be memory,
 	 *  file or ...). This method must be implemented by
@@ -72,26 +225,53 @@ private:
 	 *  @param len length of required data
 	 *  @return size of written data
 	**/
-	virtual int write(int pos, char *buf, int len) = 0;
+	virtual ssize_t write(size_t pos, char *buf, size_t len) = 0;
+
+	/** Wake-up thread blocked on a futex.
+	**/
+	static void wake(int *event, int *waiting);
+
+	/** Block on a futex.
+	**/
+	static void wait(int *event, int value, int *waiting);
+
+	/** Total number of bytes read from the buffer. Written only
+	 *  by reader. Position in storage is m_readP % m_bufferSize.
+	**/
+	uint64_t m_readP;
+
+	/** Total number of bytes that are overwritable by writer,
+	 *  m_readP minus look-behind window. Written only by reader.
+	**/
+	uint64_t m_tailP;
+
+	/** Size of look-behind window in bytes.
+	**/
+	size_t m_lookBehind;
 
-	/** Pointer to read start
+	/** Writer is woken up when data drop below it.
 	**/
-	int m_readP;
+	size_t m_lowWatermark;
 
-	/** Pointer to write start
+	/** Total number of bytes written to the buffer. Written only
+	 *  by writer. Position in storage is m_writeP % m_bufferSize.
 	**/
-	int m_writeP;
+	uint64_t m_writeP;
 
-	/** If true, buffer is full
+	/** Futex words incremented on every commit / advance.
 	**/
-	bool m_full;
+	int m_dataEvent;
+	int m_spaceEvent;
 
-	/** If true, buffer is empty
+	/** Non zero if reader / writer is blocked on its futex,
+	 *  wake-up is a system call only then.
 	**/
-	bool m_empty;
+	int m_readerWaiting;
+	int m_writerWaiting;
 
 	/** Contains size of the buffer in bytes
 	**/
-	const int m_bufferSize;
+	const size_t m_bufferSize;
 };
 
+#endif
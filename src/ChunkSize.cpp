@@ -0,0 +1,107 @@
+#include "ChunkSize.hpp"
+#include <algorithm>
+#include <iostream>
+
+extern bool g_DebugMode;
+
+/** Number of samples of a size before it is judged.
+**/
+static const int Samples = 4;
+
+/** Weight of a new sample in moving average.
+**/
+static const double Alpha = 0.25;
+
+/** Target size as multiple of latency * bandwidth, latency is then
+ *  at most 1/(1+Overlap) of the time.
+**/
+static const double Overlap = 4.0;
+
+ChunkSize::ChunkSize(size_t minSize, size_t maxSize) :
+	m_minSize(minSize),
+	m_maxSize(std::max(minSize, maxSize)),
+	m_size(minSize),
+	m_samples(0)
+{
+}
+
+size_t ChunkSize::size() const
+{
+	return __atomic_load_n(&m_size, __ATOMIC_RELAXED);
+}
+
+void ChunkSize::setSize(size_t size)
+{
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << ", " << m_size << " -> " << size << std::endl;
+
+	__atomic_store_n(&m_size, size, __ATOMIC_RELAXED);
+	m_samples = 0;
+
+	/** Measure the new size again, conditions might have changed.
+	**/
+	m_duration.erase(size);
+}
+
+void ChunkSize::sample(size_t len, double seconds)
+{
+	std::map<size_t, double>::iterator it = m_duration.find(len);
+
+	if (it == m_duration.end())
+		m_duration[len] = seconds;
+	else
+		it->second += Alpha * (seconds - it->second);
+
+	if ((len == m_size) && (++m_samples >= Samples))
+		adapt();
+}
+
+void ChunkSize::adapt()
+{
+	/** Neighbour measured last is the most accurate one, prefer
+	 *  the smaller one as it is measured on the way up.
+	**/
+	std::map<size_t, double>::iterator it = m_duration.find(m_size / 2);
+	if (it == m_duration.end())
+		it = m_duration.find(m_size * 2);
+
+	if (it == m_duration.end())
+	{
+		/** Nothing to compare with, explore a bigger size.
+		**/
+		if (m_size * 2 <= m_maxSize)
+			setSize(m_size * 2);
+		return;
+	}
+
+	double size = m_size;
+	double duration = m_duration[m_size];
+	double otherSize = it->first;
+	double otherDuration = it->second;
+
+	double target;
+	if ((duration - otherDuration) * (size - otherSize) <= 0)
+	{
+		/** Bigger reads are not slower, latency dominates.
+		**/
+		target = m_maxSize;
+	}
+	else
+	{
+		double bandwidth = (size - otherSize) / (duration - otherDuration);
+		double latency = duration - size / bandwidth;
+
+		target = Overlap * std::max(latency, 0.0) * bandwidth;
+
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", latency: " << latency << " s, bandwidth: " <<
+			             bandwidth << " B/s, target: " << target << std::endl;
+	}
+
+	if ((target >= size * 2) && (m_size * 2 <= m_maxSize))
+		setSize(m_size * 2);
+	else if ((target <= size / 2) && (m_size / 2 >= m_minSize))
+		setSize(m_size / 2);
+	else
+		m_samples = 0;
+}
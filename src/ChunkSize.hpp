@@ -0,0 +1,57 @@
+#ifndef CHUNKSIZE_HPP
+#define CHUNKSIZE_HPP
+
+#include <sys/types.h>
+#include <map>
+
+/** Size of device reads adapted to the device. Duration of a read is
+ *  modelled as latency + size / bandwidth, both are estimated from
+ *  reads of two neighbouring sizes. Size is kept a few times latency
+ *  times bandwidth so latency of each request is amortized, and is
+ *  moved toward that target by doubling or halving.
+ *
+ *  Used by a single thread, only size() may be called by others.
+**/
+class ChunkSize
+{
+public:
+	/** Constructor.
+	 *  @param minSize minimal (and initial) size in bytes
+	 *  @param maxSize maximal size in bytes
+	**/
+	ChunkSize(size_t minSize, size_t maxSize);
+
+	/** Return current size in bytes.
+	**/
+	size_t size() const;
+
+	/** Record a complete read. Reads issued before the size changed
+	 *  are kept for their own size, only reads of the current size
+	 *  count toward judging it.
+	 *  @param len size of the read in bytes
+	 *  @param seconds duration of the read
+	**/
+	void sample(size_t len, double seconds);
+
+private:
+	/** Move size toward the target given by the model.
+	**/
+	void adapt();
+
+	void setSize(size_t size);
+
+	const size_t m_minSize;
+	const size_t m_maxSize;
+
+	size_t m_size;
+
+	/** Number of samples of current size since it was set.
+	**/
+	int    m_samples;
+
+	/** Moving average of read duration for each size in seconds.
+	**/
+	std::map<size_t, double> m_duration;
+};
+
+#endif
@@ -1,14 +1,127 @@
 #include "Device.hpp"
 #include "DeviceFile.hpp"
 #include "DeviceHttp.hpp"
+#include "DeviceMirrors.hpp"
 #include <string.h>
+#include <errno.h>
 
-Device *Device::deviceFactory(const char *name)
+Device::Options::Options() :
+	connections(1),
+	pipeline(1),
+	retries(3),
+	iodepth(0),
+	direct(false)
 {
-	if (strncasecmp(name, "http://", 7) == 0)
-		return new DeviceHttp();
+}
+
+Device::Device() :
+	m_lastRequest(0)
+{
+}
+
+Device *Device::deviceFactory(const char *name, const Options& options)
+{
+	if ((strncasecmp(name, "http://", 7) == 0) && !options.mirrors.empty())
+		return new DeviceMirrors(options);
+	else if (strncasecmp(name, "http://", 7) == 0)
+		return new DeviceHttp(options);
 	else
-		return new DeviceFile();
+		return new DeviceFile(options);
+}
+
+ssize_t Device::preadv(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t total = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		ssize_t r = pread(static_cast<char *>(iov[i].iov_base), iov[i].iov_len, offset + total);
+		if (r == -1)
+			return (total > 0) ? total : -1;
+
+		total += r;
+		if (static_cast<size_t>(r) < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+void Device::preadExtents(Extent *extents, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		Extent& e = extents[i];
+		ssize_t r = 0;
+
+		e.result = 0;
+		e.error = 0;
+
+		/** Fill whole extent unless end of file is reached.
+		**/
+		while (static_cast<size_t>(e.result) < e.len)
+		{
+			r = pread(e.buf + e.result, e.len - e.result, e.offset + e.result);
+			if (r <= 0)
+				break;
+			e.result += r;
+		}
+
+		/** Data missing before end of file are an error even if
+		 *  a part was read, so the range is read again later.
+		**/
+		int error = ((r == -1) && (errno != 0)) ? errno : EIO;
+		if ((static_cast<size_t>(e.result) < e.len) && (e.offset + e.result < size()))
+		{
+			e.result = -1;
+			e.error = error;
+		}
+	}
+}
+
+uint64_t Device::submit(Request *request)
+{
+	request->id = ++m_lastRequest;
+	request->result = 0;
+	request->error = 0;
+
+	m_requests.push_back(request);
+	return request->id;
 }
 
+Device::Request *Device::complete(bool wait)
+{
+	if (!m_completed.empty())
+	{
+		Request *request = m_completed.front();
+		m_completed.pop_front();
+		return request;
+	}
+
+	if (!wait || m_requests.empty())
+		return NULL;
 
+	Request *request = m_requests.front();
+	m_requests.pop_front();
+
+	request->result = preadv(request->iov, request->iovcnt, request->offset);
+	request->error = (request->result == -1) ? errno : 0;
+	return request;
+}
+
+bool Device::cancel(uint64_t id)
+{
+	for (std::deque<Request *>::iterator i = m_requests.begin(); i != m_requests.end(); ++i)
+	{
+		if ((*i)->id != id)
+			continue;
+
+		Request *request = *i;
+		m_requests.erase(i);
+
+		request->result = -1;
+		request->error = ECANCELED;
+		m_completed.push_back(request);
+		return true;
+	}
+	return false;
+}
@@ -2,16 +2,168 @@
 #define DEVICE_HPP
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
 
 class Device
 {
 public:
-	static Device *deviceFactory(const char *name);
+	/** Settings of devices.
+	**/
+	struct Options
+	{
+		Options();
+
+		/** Number of connections used by a network device
+		**/
+		size_t connections;
+
+		/** Number of requests queued on a connection of a network
+		 *  device, 1 if requests are not pipelined
+		**/
+		size_t pipeline;
+
+		/** Number of retries of a network read that receive no data
+		**/
+		size_t retries;
+
+		/** Number of reads of a local file in flight (io_uring), 0 if
+		 *  the file is read by plain blocking reads
+		**/
+		size_t iodepth;
+
+		/** Read a local file with O_DIRECT (with io_uring only)
+		**/
+		bool direct;
+
+		/** URLs of mirrors of the opened file, it is read from all
+		 *  of them
+		**/
+		std::vector<std::string> mirrors;
+	};
+
+	/** Range of the file read by preadExtents().
+	**/
+	struct Extent
+	{
+		off_t   offset;
+		char   *buf;
+		size_t  len;
+
+		/** Number of bytes read (smaller than len only at end of
+		 *  file) or -1 on error.
+		**/
+		ssize_t result;
+
+		/** Error code if result is -1.
+		**/
+		int     error;
+	};
+
+	/** Asynchronous read of the file (like preadv(2)), see submit().
+	**/
+	struct Request
+	{
+		off_t               offset;
+		const struct iovec *iov;
+		int                 iovcnt;
+
+		/** Number of bytes read or -1 on error, valid once the
+		 *  request is returned by complete().
+		**/
+		ssize_t             result;
+
+		/** Error code if result is -1, ECANCELED if the request
+		 *  has been cancelled before it was read.
+		**/
+		int                 error;
+
+		/** Identification assigned by submit().
+		**/
+		uint64_t            id;
+	};
+
+	Device();
+
+	static Device *deviceFactory(const char *name, const Options& options);
+	virtual ~Device() { }
 
 	virtual bool open(const char *name) = 0;
 	virtual ssize_t pread(char *buf, size_t len, off_t offset) = 0;
+
+	/** Read data into several buffers at once (like preadv(2)).
+	 *  Default implementation calls pread() for each buffer.
+	**/
+	virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset);
+
+	/** Read several ranges of the file at once, network devices
+	 *  fetch them in one round trip. Default implementation calls
+	 *  pread() for each range.
+	**/
+	virtual void preadExtents(Extent *extents, size_t count);
 	virtual off_t size() = 0;
 	virtual void cancel() = 0;
+
+	/** Queue an asynchronous read. The request and its buffers must
+	 *  stay valid until complete() returns it. Reads must not be
+	 *  mixed with synchronous ones of the same device by other
+	 *  threads, a device is used by a single thread.
+	 *  @return id of the request
+	**/
+	virtual uint64_t submit(Request *request);
+
+	/** Take a completed request, every submitted request is returned
+	 *  exactly once. Default implementation reads requests one by
+	 *  one by preadv() in order of submission.
+	 *  @param wait if true, read until a request completes,
+	 *  otherwise return only requests completed already
+	 *  @return completed request, NULL if there is none (or on
+	 *  error of the device if wait is true, errno is set)
+	**/
+	virtual Request *complete(bool wait);
+
+	/** Cancel submitted request. It is still returned by complete(),
+	 *  failed with ECANCELED unless it has been read already.
+	 *  @return false if the request is not in flight
+	**/
+	virtual bool cancel(uint64_t id);
+
+	/** True if submit() keeps several reads in flight by itself,
+	 *  a single device is enough for a deep queue then.
+	**/
+	virtual bool asynchronous() const { return false; }
+
+	/** Identification of the file content (e.g. ETag), changes
+	 *  whenever the content changes. Empty if not known.
+	**/
+	virtual std::string version() { return std::string(); }
+
+	/** True if the device reads efficiently only at consecutive
+	 *  offsets (a stream), it should be read by a single thread.
+	**/
+	virtual bool sequential() const { return false; }
+
+	/** Create another device reading the same file, it is opened
+	 *  already and shares nothing with this one. Must be called
+	 *  on opened device.
+	 *  @return new device or NULL if not supported
+	**/
+	virtual Device *clone() const { return NULL; }
+
+protected:
+	/** Requests submitted and not started yet, and requests completed
+	 *  and not returned by complete() yet.
+	**/
+	std::deque<Request *> m_requests;
+	std::deque<Request *> m_completed;
+
+private:
+	/** Id of the last submitted request.
+	**/
+	uint64_t m_lastRequest;
 };
 
 
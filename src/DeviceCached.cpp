@@ -0,0 +1,253 @@
+#include "DeviceCached.hpp"
+#include "DiskCache.hpp"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <iostream>
+
+extern bool g_DebugMode;
+
+DeviceCached::DeviceCached(Device *device, DiskCache *cache) :
+	m_device(device),
+	m_cache(cache),
+	m_usable(false),
+	m_size(0)
+{
+}
+
+DeviceCached::~DeviceCached()
+{
+	delete m_device;
+}
+
+bool DeviceCached::open(const char *name)
+{
+	if (!m_device->open(name))
+		return false;
+
+	m_size = m_device->size();
+	m_usable = m_cache->open(name, m_size, m_device->version());
+
+	return true;
+}
+
+Device *DeviceCached::clone() const
+{
+	Device *device = m_device->clone();
+	if (device == NULL)
+		return NULL;
+
+	DeviceCached *dev = new DeviceCached(device, m_cache);
+	dev->m_usable = m_usable;
+	dev->m_size = m_size;
+	return dev;
+}
+
+ssize_t DeviceCached::pread(char *buf, size_t len, off_t offset)
+{
+	if (!m_usable)
+		return m_device->pread(buf, len, offset);
+
+	if (offset >= m_size)
+		return 0;
+	len = std::min<off_t>(len, m_size - offset);
+
+	if (!ensure(offset, len))
+		return -1;
+
+	/** Cache could not store the data, read around it.
+	**/
+	if (!m_usable)
+		return m_device->pread(buf, len, offset);
+
+	return ::pread(m_cache->fd(), buf, len, offset);
+}
+
+ssize_t DeviceCached::preadv(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	if (!m_usable)
+		return m_device->preadv(iov, iovcnt, offset);
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (offset >= m_size)
+		return 0;
+	len = std::min<off_t>(len, m_size - offset);
+
+	if (!ensure(offset, len))
+		return -1;
+
+	if (!m_usable)
+		return m_device->preadv(iov, iovcnt, offset);
+
+	return ::preadv(m_cache->fd(), iov, iovcnt, offset);
+}
+
+void DeviceCached::preadExtents(Extent *extents, size_t count)
+{
+	if (!m_usable)
+	{
+		m_device->preadExtents(extents, count);
+		return;
+	}
+
+	/** Chunks missing in any extent are fetched together.
+	**/
+	std::set<off_t> missing;
+	for (size_t i = 0; i < count; i++)
+	{
+		if ((extents[i].offset >= m_size) || (extents[i].len == 0))
+			continue;
+
+		off_t first = extents[i].offset / DiskCache::ChunkSize;
+		off_t last = (std::min<off_t>(extents[i].offset + extents[i].len, m_size) - 1) / DiskCache::ChunkSize;
+
+		for (off_t chunk = first; chunk <= last; chunk++)
+		{
+			if (!m_cache->present(chunk))
+				missing.insert(chunk);
+		}
+	}
+
+	if (!missing.empty())
+		fetch(missing);
+
+	/** Read extents from the cache file, chunks that failed are
+	 *  fetched again one by one.
+	**/
+	Device::preadExtents(extents, count);
+}
+
+bool DeviceCached::sequential() const
+{
+	return m_device->sequential();
+}
+
+off_t DeviceCached::size()
+{
+	return m_size;
+}
+
+void DeviceCached::cancel()
+{
+	m_device->cancel();
+}
+
+std::string DeviceCached::version()
+{
+	return m_device->version();
+}
+
+bool DeviceCached::ensure(off_t offset, size_t len)
+{
+	off_t first = offset / DiskCache::ChunkSize;
+	off_t last = (offset + len - 1) / DiskCache::ChunkSize;
+
+	/** Fetch every run of missing chunks at once.
+	**/
+	for (off_t chunk = first; chunk <= last; chunk++)
+	{
+		if (m_cache->present(chunk))
+			continue;
+
+		off_t end = chunk;
+		while ((end < last) && !m_cache->present(end + 1))
+			end++;
+
+		if (!fetch(chunk, end))
+			return false;
+		if (!m_usable)
+			return true;
+
+		chunk = end;
+	}
+	return true;
+}
+
+bool DeviceCached::fetch(off_t first, off_t last)
+{
+	off_t offset = first * DiskCache::ChunkSize;
+	size_t len = std::min<off_t>((last - first + 1) * DiskCache::ChunkSize, m_size - offset);
+	size_t done = 0;
+
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << ", chunks: " << first << "-" << last << std::endl;
+
+	m_buf.resize(len);
+
+	while (done < len)
+	{
+		ssize_t r = m_device->pread(&m_buf[done], len - done, offset + done);
+		if (r == -1)
+			return false;
+		if (r == 0)
+		{
+			errno = EIO;
+			return false;
+		}
+		done += r;
+	}
+
+	/** Failing cache (e.g. full disk) is not an error of the read,
+	 *  the device is used directly from now on.
+	**/
+	if (!m_cache->store(&m_buf[0], len, offset))
+	{
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", store failed, errno: " << errno << std::endl;
+		m_usable = false;
+	}
+	return true;
+}
+
+void DeviceCached::fetch(const std::set<off_t>& chunks)
+{
+	/** Runs of consecutive chunks are fetched as one extent.
+	**/
+	std::vector<Extent> runs;
+	size_t total = 0;
+
+	for (std::set<off_t>::const_iterator i = chunks.begin(); i != chunks.end(); ++i)
+	{
+		off_t offset = *i * DiskCache::ChunkSize;
+		size_t len = std::min<off_t>(DiskCache::ChunkSize, m_size - offset);
+
+		if (!runs.empty() && (runs.back().offset + static_cast<off_t>(runs.back().len) == offset))
+		{
+			runs.back().len += len;
+		}
+		else
+		{
+			Extent run;
+			run.offset = offset;
+			run.buf = NULL;
+			run.len = len;
+			runs.push_back(run);
+		}
+		total += len;
+	}
+
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << ", chunks: " << chunks.size() << ", runs: " << runs.size() << std::endl;
+
+	m_buf.resize(total);
+
+	size_t used = 0;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		runs[i].buf = &m_buf[used];
+		used += runs[i].len;
+	}
+
+	m_device->preadExtents(&runs[0], runs.size());
+
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		if (runs[i].result == static_cast<ssize_t>(runs[i].len))
+			m_cache->store(runs[i].buf, runs[i].len, runs[i].offset);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef DEVICECACHED_HPP
+#define DEVICECACHED_HPP
+
+#include "Device.hpp"
+#include <string>
+#include <vector>
+#include <set>
+
+class DiskCache;
+
+/** Device reading through a persistent cache (see DiskCache). Data
+ *  present in the cache are read locally, missing ones are fetched
+ *  from another device and stored to the cache.
+**/
+class DeviceCached : public Device
+{
+public:
+	/** Constructor.
+	 *  @param device device to cache, owned by this object
+	 *  @param cache cache shared with other devices
+	**/
+	DeviceCached(Device *device, DiskCache *cache);
+	~DeviceCached();
+
+	bool open(const char *name);
+	ssize_t pread(char *buf, size_t len, off_t offset);
+	ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset);
+	void preadExtents(Extent *extents, size_t count);
+	off_t size();
+	void cancel();
+	using Device::cancel;
+	std::string version();
+	bool sequential() const;
+	Device *clone() const;
+
+private:
+	/** Make sure all chunks covering the range are in the cache file,
+	 *  unless the cache turns unusable (m_usable is cleared).
+	 *  @return false on error (errno is set)
+	**/
+	bool ensure(off_t offset, size_t len);
+
+	/** Fetch chunks [first, last] from the device to the cache file.
+	 *  If the cache fails to store them, m_usable is cleared.
+	 *  @return false if the device read failed (errno is set)
+	**/
+	bool fetch(off_t first, off_t last);
+
+	/** Fetch chunks from the device to the cache file by a single
+	 *  batched read. Chunks that fail are left missing.
+	**/
+	void fetch(const std::set<off_t>& chunks);
+
+	Device     *m_device;
+	DiskCache  *m_cache;
+
+	/** True if the cache can be used for the opened file.
+	**/
+	bool        m_usable;
+
+	off_t       m_size;
+
+	/** Buffer for data fetched from the device.
+	**/
+	std::vector<char> m_buf;
+};
+
+#endif
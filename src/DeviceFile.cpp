@@ -1,23 +1,508 @@
 #include "DeviceFile.hpp"
+#include "Uring.hpp"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+extern bool g_DebugMode;
+
+/** Size of a part of a read that is a single io_uring request.
+**/
+static const size_t SegmentSize = 128 * 1024;
+
+/** Alignment of O_DIRECT reads (sector and page size).
+**/
+static const size_t Align = 4096;
+
+/** Tags of asynchronous requests (with their id) and of their
+ *  cancellations, segments of ringRead() are tagged by index.
+**/
+static const uint64_t RequestTag = 1ULL << 63;
+static const uint64_t CancelTag = 1ULL << 62;
+
+DeviceFile::DeviceFile(const Options& options) :
+	m_options(options),
+	m_fd(-1),
+	m_ring(NULL),
+	m_direct(false),
+	m_fixed(false),
+	m_cancelled(false)
+{
+}
+
+DeviceFile::~DeviceFile()
+{
+	delete m_ring;
+
+	for (size_t i = 0; i < m_bounce.size(); i++)
+		free(m_bounce[i]);
+
+	if (m_fd != -1)
+		close(m_fd);
+}
 
 bool DeviceFile::open(const char *name)
 {
-	m_fd = ::open(name, O_RDONLY);
+	/** O_DIRECT is used with io_uring only, file systems that don't
+	 *  support it are read through page cache.
+	**/
+	m_direct = m_options.direct && (m_options.iodepth > 0);
+	if (m_direct)
+	{
+		m_fd = ::open(name, O_RDONLY | O_DIRECT);
+		if (m_fd == -1)
+			m_direct = false;
+	}
+	if (m_fd == -1)
+		m_fd = ::open(name, O_RDONLY);
 	if (m_fd == -1)
 		return false;
+
+	setup();
 	return true;
 }
 
+Device *DeviceFile::clone() const
+{
+	int fd = ::dup(m_fd);
+	if (fd == -1)
+		return NULL;
+
+	/** Descriptors share O_DIRECT, each device has its own ring.
+	**/
+	DeviceFile *dev = new DeviceFile(m_options);
+	dev->m_fd = fd;
+	dev->m_direct = m_direct;
+	dev->setup();
+	return dev;
+}
+
+void DeviceFile::setup()
+{
+	if (m_options.iodepth == 0)
+		return;
+
+	m_ring = new Uring();
+	if (!m_ring->init(m_options.iodepth))
+	{
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", io_uring not available: " << errno << std::endl;
+
+		delete m_ring;
+		m_ring = NULL;
+
+		/** Plain reads don't handle alignment.
+		**/
+		if (m_direct)
+		{
+			fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+			m_direct = false;
+		}
+		return;
+	}
+
+	if (!m_direct)
+		return;
+
+	/** Segments that are not aligned are read to bounce buffers,
+	 *  registered ones are faster if the locked memory limit
+	 *  allows them.
+	**/
+	std::vector<struct iovec> iov;
+	for (unsigned i = 0; i < m_ring->depth(); i++)
+	{
+		void *buf = NULL;
+		if (posix_memalign(&buf, Align, SegmentSize + 2 * Align) != 0)
+			break;
+
+		struct iovec v;
+		v.iov_base = buf;
+		v.iov_len = SegmentSize + 2 * Align;
+		iov.push_back(v);
+
+		m_bounce.push_back(static_cast<char *>(buf));
+		m_freeBounce.push_back(i);
+	}
+
+	if (iov.empty())
+	{
+		fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+		m_direct = false;
+		return;
+	}
+
+	m_fixed = m_ring->registerBuffers(&iov[0], iov.size());
+}
+
 ssize_t DeviceFile::pread(char *buf, size_t len, off_t offset)
 {
+	if (m_ring != NULL)
+	{
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = len;
+
+		return ringRead(&iov, 1, offset);
+	}
+
 	return ::pread(m_fd, buf, len, offset);
 }
 
+ssize_t DeviceFile::preadv(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	if (m_ring != NULL)
+		return ringRead(iov, iovcnt, offset);
+
+	return ::preadv(m_fd, iov, iovcnt, offset);
+}
+
+/** Return true if value is a multiple of alignment.
+**/
+static bool aligned(uintptr_t value, size_t alignment)
+{
+	return (value % alignment) == 0;
+}
+
+ssize_t DeviceFile::ringRead(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (total == 0)
+		return 0;
+
+	/** Split the read to segments, each segment describes its part
+	 *  of destination buffers.
+	**/
+	size_t count = (total + SegmentSize - 1) / SegmentSize;
+	if (m_segments.size() < count)
+		m_segments.resize(count);
+
+	int i = 0;
+	size_t skip = 0;
+	for (size_t s = 0; s < count; s++)
+	{
+		Segment& segment = m_segments[s];
+		segment.offset = offset + s * SegmentSize;
+		segment.len = std::min(SegmentSize, total - s * SegmentSize);
+		segment.iov.clear();
+		segment.bounce = -1;
+		segment.result = 0;
+
+		bool direct = aligned(segment.offset, Align) && aligned(segment.len, Align);
+		size_t len = segment.len;
+		while (len > 0)
+		{
+			struct iovec part;
+			part.iov_base = static_cast<char *>(iov[i].iov_base) + skip;
+			part.iov_len = std::min(iov[i].iov_len - skip, len);
+			segment.iov.push_back(part);
+
+			direct = direct && aligned(reinterpret_cast<uintptr_t>(part.iov_base), Align) && aligned(part.iov_len, Align);
+
+			len -= part.iov_len;
+			skip += part.iov_len;
+			if (skip == iov[i].iov_len)
+			{
+				i++;
+				skip = 0;
+			}
+		}
+
+		/** O_DIRECT needs aligned file range and buffers, other
+		 *  segments go through a bounce buffer.
+		**/
+		if (m_direct && !direct)
+		{
+			segment.start = segment.offset - segment.offset % Align;
+			segment.length = (segment.offset + segment.len - segment.start + Align - 1) / Align * Align;
+			segment.bounce = -2;
+		}
+	}
+
+	/** Keep the ring full until all segments complete. Once the
+	 *  read is cancelled, only segments in flight are waited for.
+	**/
+	size_t next = 0;
+	size_t inFlight = 0;
+	size_t done = 0;
+	bool stopped = false;
+
+	__atomic_store_n(&m_cancelled, false, __ATOMIC_RELEASE);
+
+	while (done < (stopped ? next : count))
+	{
+		if (!stopped && __atomic_exchange_n(&m_cancelled, false, __ATOMIC_ACQ_REL))
+		{
+			stopped = true;
+			if (done == next)
+				break;
+		}
+
+		while (!stopped && (next < count) && queue(next))
+		{
+			next++;
+			inFlight++;
+		}
+
+		if (!m_ring->submit(1))
+			return -1;
+
+		uint64_t tag;
+		int result;
+		while (m_ring->complete(tag, result))
+		{
+			/** Asynchronous requests complete meanwhile too.
+			**/
+			if (tag >= CancelTag)
+			{
+				finish(tag, result);
+				continue;
+			}
+
+			Segment& segment = m_segments[tag];
+			segment.result = result;
+
+			if (segment.bounce >= 0)
+			{
+				/** Copy data of the segment out of bounce buffer.
+				**/
+				if (result > 0)
+				{
+					size_t head = segment.offset - segment.start;
+					size_t n = (static_cast<size_t>(result) > head) ? std::min(result - head, segment.len) : 0;
+					const char *data = m_bounce[segment.bounce] + head;
+
+					segment.result = n;
+					for (size_t k = 0; (k < segment.iov.size()) && (n > 0); k++)
+					{
+						size_t c = std::min(segment.iov[k].iov_len, n);
+						memcpy(segment.iov[k].iov_base, data, c);
+						data += c;
+						n -= c;
+					}
+				}
+				m_freeBounce.push_back(segment.bounce);
+				segment.bounce = -2;
+			}
+
+			inFlight--;
+			done++;
+		}
+	}
+
+	/** Return data read in one piece from the start.
+	**/
+	ssize_t r = 0;
+	for (size_t s = 0; s < count; s++)
+	{
+		if (m_segments[s].result < 0)
+		{
+			if (r == 0)
+			{
+				errno = -m_segments[s].result;
+				return -1;
+			}
+			break;
+		}
+
+		r += m_segments[s].result;
+		if (static_cast<size_t>(m_segments[s].result) < m_segments[s].len)
+			break;
+	}
+
+	if (stopped && (r == 0))
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+	return r;
+}
+
+bool DeviceFile::queue(size_t index)
+{
+	Segment& segment = m_segments[index];
+
+	if (segment.bounce == -1)
+		return m_ring->readv(m_fd, &segment.iov[0], segment.iov.size(), segment.offset, index);
+
+	if (m_freeBounce.empty())
+		return false;
+
+	int bounce = m_freeBounce.back();
+	bool queued;
+
+	if (m_fixed)
+	{
+		queued = m_ring->readFixed(m_fd, m_bounce[bounce], segment.length, segment.start, bounce, index);
+	}
+	else
+	{
+		segment.buffer.iov_base = m_bounce[bounce];
+		segment.buffer.iov_len = segment.length;
+		queued = m_ring->readv(m_fd, &segment.buffer, 1, segment.start, index);
+	}
+
+	if (queued)
+	{
+		m_freeBounce.pop_back();
+		segment.bounce = bounce;
+	}
+	return queued;
+}
+
+uint64_t DeviceFile::submit(Request *request)
+{
+	uint64_t id = Device::submit(request);
+
+	/** Errors of the ring are reported by complete().
+	**/
+	if (m_ring != NULL)
+	{
+		issue();
+		m_ring->submit(0);
+	}
+	return id;
+}
+
+Device::Request *DeviceFile::complete(bool wait)
+{
+	if (m_ring == NULL)
+		return Device::complete(wait);
+
+	if (__atomic_exchange_n(&m_cancelled, false, __ATOMIC_ACQ_REL))
+	{
+		while (!m_requests.empty())
+			Device::cancel(m_requests.front()->id);
+
+		for (std::map<uint64_t, Request *>::iterator i = m_inFlight.begin(); i != m_inFlight.end(); ++i)
+			cancel(i->first);
+	}
+
+	while (m_completed.empty())
+	{
+		issue();
+		if (!m_ring->submit((wait && !m_inFlight.empty()) ? 1 : 0))
+			return NULL;
+		reap();
+
+		if (!m_completed.empty() || !wait)
+			break;
+
+		if (m_inFlight.empty())
+		{
+			if (m_requests.empty())
+				return NULL;
+
+			/** Unaligned read with O_DIRECT goes through bounce
+			 *  buffers.
+			**/
+			Request *request = m_requests.front();
+			m_requests.pop_front();
+
+			request->result = ringRead(request->iov, request->iovcnt, request->offset);
+			request->error = (request->result == -1) ? errno : 0;
+			return request;
+		}
+	}
+
+	if (m_completed.empty())
+		return NULL;
+
+	Request *request = m_completed.front();
+	m_completed.pop_front();
+	return request;
+}
+
+void DeviceFile::cancel()
+{
+	/** Plain reads are not interrupted, reads through the ring
+	 *  notice it between completions.
+	**/
+	__atomic_store_n(&m_cancelled, true, __ATOMIC_RELEASE);
+}
+
+bool DeviceFile::cancel(uint64_t id)
+{
+	if (Device::cancel(id))
+		return true;
+
+	if ((m_ring == NULL) || (m_inFlight.count(id) == 0))
+		return false;
+
+	/** Make room in the submission queue. Reads that are in
+	 *  progress already are not cancelled, they complete.
+	**/
+	if (!m_ring->submit(0) || !m_ring->cancel(RequestTag | id, CancelTag))
+		return false;
+	m_ring->submit(0);
+	return true;
+}
+
+bool DeviceFile::asynchronous() const
+{
+	return m_ring != NULL;
+}
+
+void DeviceFile::issue()
+{
+	while (!m_requests.empty() && (m_inFlight.size() < m_ring->depth()))
+	{
+		Request *request = m_requests.front();
+
+		bool direct = aligned(request->offset, Align);
+		for (int i = 0; i < request->iovcnt; i++)
+			direct = direct && aligned(reinterpret_cast<uintptr_t>(request->iov[i].iov_base), Align) && aligned(request->iov[i].iov_len, Align);
+
+		if (m_direct && !direct)
+			break;
+
+		if (!m_ring->readv(m_fd, request->iov, request->iovcnt, request->offset, RequestTag | request->id))
+			break;
+
+		m_requests.pop_front();
+		m_inFlight[request->id] = request;
+	}
+}
+
+void DeviceFile::reap()
+{
+	uint64_t tag;
+	int result;
+
+	while (m_ring->complete(tag, result))
+		finish(tag, result);
+}
+
+void DeviceFile::finish(uint64_t tag, int result)
+{
+	/** Result of cancellation itself is not interesting.
+	**/
+	if ((tag & RequestTag) == 0)
+		return;
+
+	std::map<uint64_t, Request *>::iterator i = m_inFlight.find(tag & ~RequestTag);
+	if (i == m_inFlight.end())
+		return;
+
+	Request *request = i->second;
+	m_inFlight.erase(i);
+
+	request->result = (result < 0) ? -1 : result;
+	request->error = (result < 0) ? -result : 0;
+	m_completed.push_back(request);
+}
+
 off_t DeviceFile::size()
 {
 	struct stat st;
@@ -26,3 +511,14 @@ off_t DeviceFile::size()
 	return 0;
 }
 
+
+std::string DeviceFile::version()
+{
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+		return std::string();
+
+	std::ostringstream version;
+	version << st.st_dev << ":" << st.st_ino << ":" << st.st_mtime;
+	return version.str();
+}
@@ -2,18 +2,115 @@
 #define DEVICEFILE_HPP
 
 #include "Device.hpp"
+#include <vector>
+#include <map>
+
+class Uring;
 
 class DeviceFile : public Device
 {
 public:
+	DeviceFile(const Options& options);
+	~DeviceFile();
 	bool open(const char *name);
 	ssize_t pread(char *buf, size_t len, off_t offset);
+	ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset);
 	off_t size();
-	void cancel() { };
+	void cancel();
+	std::string version();
+	Device *clone() const;
+
+	uint64_t submit(Request *request);
+	Request *complete(bool wait);
+	bool cancel(uint64_t id);
+	bool asynchronous() const;
 
 private:
+	/** Part of a read that is a single io_uring request.
+	**/
+	struct Segment
+	{
+		off_t  offset;
+		size_t len;
+
+		/** Destination buffers of the segment.
+		**/
+		std::vector<struct iovec> iov;
+
+		/** Index of bounce buffer used if destination is not
+		 *  aligned for O_DIRECT, -1 if not used, -2 if the segment
+		 *  doesn't hold one now.
+		**/
+		int    bounce;
+
+		/** Range [start, start + length) read to bounce buffer.
+		**/
+		off_t  start;
+		size_t length;
+		struct iovec buffer;
+
+		ssize_t result;
+	};
+
+	/** Set up io_uring (and bounce buffers for O_DIRECT) for the
+	 *  opened file. Plain reads are used if it is not available.
+	**/
+	void setup();
+
+	/** Read by segments kept in flight by io_uring.
+	**/
+	ssize_t ringRead(const struct iovec *iov, int iovcnt, off_t offset);
+
+	/** Queue read of segment.
+	 *  @return false if it can't be queued now
+	**/
+	bool queue(size_t index);
+
+	/** Queue submitted requests to the ring while there is room.
+	 *  With O_DIRECT, a request that is not aligned stops it, it
+	 *  is read by ringRead() once it is the first one.
+	**/
+	void issue();
+
+	/** Take completions of asynchronous requests from the ring.
+	**/
+	void reap();
+
+	/** Account completion of an asynchronous request or of its
+	 *  cancellation.
+	**/
+	void finish(uint64_t tag, int result);
+
+	Options m_options;
+
 	int m_fd;
+
+	/** Ring, NULL if reads are plain preadv(2).
+	**/
+	Uring *m_ring;
+
+	/** True if file is opened with O_DIRECT.
+	**/
+	bool m_direct;
+
+	/** Aligned bounce buffers, one for each request in flight,
+	 *  and indexes of free ones. If m_fixed is true, they are
+	 *  registered to the ring.
+	**/
+	std::vector<char *> m_bounce;
+	std::vector<int> m_freeBounce;
+	bool m_fixed;
+
+	std::vector<Segment> m_segments;
+
+	/** Asynchronous requests in the ring by id.
+	**/
+	std::map<uint64_t, Request *> m_inFlight;
+
+	/** Set by cancel() (possibly by another thread), taken by the
+	 *  read in progress.
+	**/
+	bool m_cancelled;
 };
 
 #endif
-
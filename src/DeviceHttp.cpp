@@ -1,17 +1,72 @@
 #include "DeviceHttp.hpp"
-#include <strstream>
+#include <iostream>
+#include <algorithm>
+#include <sstream>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 extern bool g_DebugMode;
 
-DeviceHttp::DeviceHttp():
+DeviceHttp::Connection::Connection(boost::asio::io_service& ioservice) :
+	kind(Ranges),
+	socket(new boost::asio::ip::tcp::socket(ioservice)),
+	response(MaxResponse),
+	contentLength(0),
+	start(0),
+	len(0),
+	requested(0),
+	next(0),
+	data(NULL),
+	size(0),
+	received(0),
+	error(false),
+	closed(true),
+	skipping(false),
+	nextAttempt(0),
+	attemptTimer(ioservice),
+	connecting(false),
+	extents(NULL)
+{
+}
+
+DeviceHttp::Connection::~Connection()
+{
+	for (size_t i = 0; i < attempts.size(); i++)
+		delete attempts[i];
+	delete socket;
+}
+
+DeviceHttp::DeviceHttp(const Options& options):
 	m_resolver(m_ioservice),
-	m_socket(m_ioservice),
-	m_error(false),
-	m_closed(false)
+	m_timer(m_ioservice),
+	m_options(options),
+	m_retries(options.retries),
+	m_fileSize(0),
+	m_pipeline(std::max<size_t>(options.pipeline, 1)),
+	m_stride(0),
+	m_lastStride(0),
+	m_multiRange(true),
+	m_stream(false),
+	m_streamOpen(false),
+	m_streamOffset(0),
+	m_bodyLeft(-1),
+	m_chunked(false),
+	m_chunkLeft(0),
+	m_cancelled(false),
+	m_aborted(false)
 {
+	for (size_t i = 0; i < std::max<size_t>(options.connections, 1); i++)
+		m_connections.push_back(new Connection(m_ioservice));
+}
+
+DeviceHttp::~DeviceHttp()
+{
+	for (size_t i = 0; i < m_connections.size(); i++)
+		delete m_connections[i];
 }
 
 void DeviceHttp::cancel()
@@ -19,23 +74,169 @@ void DeviceHttp::cancel()
 	if (g_DebugMode)
 		std::cout << __PRETTY_FUNCTION__ << "\n";
 
+	// Called by another thread, the read in progress notices it when
+	// the io_service stops.
+	__atomic_store_n(&m_cancelled, true, __ATOMIC_RELEASE);
 	m_ioservice.stop();
 }
 
+bool DeviceHttp::cancelled()
+{
+	return __atomic_exchange_n(&m_cancelled, false, __ATOMIC_ACQ_REL);
+}
+
+void DeviceHttp::abort(size_t parts)
+{
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << " parts: " << parts << "\n";
+
+	m_aborted = true;
+
+	// Drop connections of parts, handlers of operations in progress
+	// complete with errors and start nothing new. Responses queued on
+	// them are not wanted anymore.
+	boost::system::error_code ignored;
+	for (size_t i = 0; i < parts; i++)
+	{
+		Connection *c = m_connections[i];
+
+		c->connecting = false;
+		c->attemptTimer.cancel();
+		for (size_t k = 0; k < c->attempts.size(); k++)
+			c->attempts[k]->close(ignored);
+		c->socket->close(ignored);
+		c->queued.clear();
+		c->closed = true;
+	}
+	m_resolver.cancel();
+	m_timer.cancel();
+
+	do
+	{
+		m_ioservice.reset();
+		m_ioservice.run();
+	}
+	while (cancelled());
+
+	for (size_t i = 0; i < parts; i++)
+	{
+		Connection *c = m_connections[i];
+
+		if (c->received < c->len)
+			c->error = true;
+	}
+}
+
+bool DeviceHttp::dropped(Connection *c)
+{
+	if (!m_aborted)
+		return false;
+
+	c->error = true;
+	c->closed = true;
+	c->request.consume(c->request.size());
+	return true;
+}
+
+void DeviceHttp::runStream()
+{
+	// A stream is not interrupted, it would have to be requested from
+	// the start again.
+	do
+	{
+		m_ioservice.reset();
+		m_ioservice.run();
+	}
+	while (cancelled());
+}
+
 bool DeviceHttp::open(const char *url)
 {
 	if (g_DebugMode)
 		std::cout << __PRETTY_FUNCTION__ << "\n";
 
+	Connection *c = m_connections[0];
+
 	parseUrl(url);
-	resolve();
 
-	if (g_DebugMode)
-		std::cout << " reset/run\n";
+	// Size of the file comes with the first range of it, it is kept
+	// for the first read.
+	m_head.resize(HeadSize);
 
-	m_ioservice.run();
+	c->start = 0;
+	c->len = m_head.size();
+	c->iov.resize(1);
+	c->iov[0].iov_base = &m_head[0];
+	c->iov[0].iov_len = m_head.size();
+	reset(c);
+	c->error = true;
+
+	fetch(1, 0);
+
+	if (m_stream && !c->error)
+	{
+		// Server ignores ranges, beginning of the file is read from
+		// the stream.
+		bool sized = (m_bodyLeft >= 0);
+		struct iovec iov;
+		iov.iov_base = &m_head[0];
+		iov.iov_len = m_head.size();
+
+		ssize_t r = streamRead(&iov, 1, 0);
+		if (r == -1)
+			return false;
+		m_head.resize(r);
+
+		// Size of a chunked body is known if it ends in the head,
+		// request headers only otherwise.
+		if (!sized && (m_bodyLeft == 0))
+		{
+			m_fileSize = r;
+		}
+		else if (!sized)
+		{
+			c->kind = Connection::Headers;
+			c->closed = true;
+			m_streamOpen = false;
+			reset(c);
+			c->error = true;
+
+			fetch(1, 0);
+
+			if (!c->error && (m_fileSize < r))
+			{
+				if (g_DebugMode)
+					std::cout << "Size of the file is not known\n";
+
+				c->error = true;
+				errno = ENOENT;
+			}
+		}
+		return !c->error;
+	}
+
+	m_head.resize(c->received);
+
+	return !c->error;
+}
+
+Device *DeviceHttp::clone() const
+{
+	DeviceHttp *dev = new DeviceHttp(m_options);
+
+	dev->m_server = m_server;
+	dev->m_path = m_path;
+	dev->m_endpoints = m_endpoints;
+	dev->m_lastEndpoint = m_lastEndpoint;
+	dev->m_fileSize = m_fileSize;
+	dev->m_pipeline = m_pipeline;
+	dev->m_multiRange = m_multiRange;
+	dev->m_stream = m_stream;
+	dev->m_etag = m_etag;
+	dev->m_lastModified = m_lastModified;
+	dev->m_head = m_head;
 
-	return !m_error;
+	return dev;
 }
 
 off_t DeviceHttp::size()
@@ -43,72 +244,312 @@ off_t DeviceHttp::size()
 	return m_fileSize;
 }
 
+bool DeviceHttp::sequential() const
+{
+	return m_stream;
+}
+
+std::string DeviceHttp::version()
+{
+	return m_etag.empty() ? m_lastModified : m_etag;
+}
+
 ssize_t DeviceHttp::pread(char *destination, size_t size, off_t start)
 {
+	struct iovec iov;
+
+	iov.iov_base = destination;
+	iov.iov_len = size;
+
+	return preadv(&iov, 1, start);
+}
+
+/** Describe part [skip, skip + len) of buffers as another array of buffers.
+**/
+static void slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len, std::vector<struct iovec>& out)
+{
+	out.clear();
+
+	for (int i = 0; (i < iovcnt) && (len > 0); i++)
+	{
+		if (skip >= iov[i].iov_len)
+		{
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		struct iovec part;
+		part.iov_base = static_cast<char *>(iov[i].iov_base) + skip;
+		part.iov_len = std::min(iov[i].iov_len - skip, len);
+		out.push_back(part);
+
+		len -= part.iov_len;
+		skip = 0;
+	}
+}
+
+ssize_t DeviceHttp::preadv(const struct iovec *iov, int iovcnt, off_t start)
+{
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
 	if (g_DebugMode)
 		std::cout << __PRETTY_FUNCTION__ << std::hex << " size: " << size << ", start: " << start << std::dec << "\n";
 
-	off_t end = start + size - 1;
-
-	if (start >= m_fileSize)
+	if ((start >= m_fileSize) || (size == 0))
 		return 0;
 
-	m_data = destination;
-	m_size = size;
+	// Beginning of the file is received already by open().
+	if (static_cast<size_t>(start) < m_head.size())
+	{
+		size_t n = std::min(size, m_head.size() - start);
+		size_t copied = 0;
+
+		for (int i = 0; (i < iovcnt) && (copied < n); i++)
+		{
+			size_t k = std::min(iov[i].iov_len, n - copied);
+			memcpy(iov[i].iov_base, &m_head[start + copied], k);
+			copied += k;
+		}
+
+		if (n == size)
+			return n;
+
+		std::vector<struct iovec> rest;
+		slice(iov, iovcnt, n, size - n, rest);
+
+		ssize_t r = preadv(&rest[0], rest.size(), start + n);
+		return (r == -1) ? n : n + r;
+	}
+
+	if (m_stream)
+		return streamRead(iov, iovcnt, start);
 
-	int attempt;
-	for (attempt = 1; attempt <= 4; attempt++)
+	Request request;
+	request.offset = start;
+	request.iov = iov;
+	request.iovcnt = iovcnt;
+
+	std::vector<Request *> requests(1, &request);
+	fetchRequests(requests, std::min<off_t>(size, m_fileSize - start));
+
+	if (request.result == -1)
+		errno = request.error;
+	return request.result;
+}
+
+/** Return number of bytes to read by request.
+**/
+static size_t length(const Device::Request *request)
+{
+	size_t size = 0;
+	for (int i = 0; i < request->iovcnt; i++)
+		size += request->iov[i].iov_len;
+	return size;
+}
+
+void DeviceHttp::fetchRequests(const std::vector<Request *>& requests, off_t stride)
+{
+	// Every request has its own connections.
+	while (m_connections.size() < std::max<size_t>(m_options.connections, 1) * requests.size())
+		m_connections.push_back(new Connection(m_ioservice));
+
+	// Split each read to parts fetched by connections in parallel.
+	std::vector<size_t> first(requests.size() + 1, 0);
+	for (size_t r = 0; r < requests.size(); r++)
 	{
-		m_error = false;
+		Request *request = requests[r];
+		size_t size = std::min<off_t>(length(request), m_fileSize - request->offset);
+		size_t parts = std::max<size_t>(std::min(m_connections.size() / requests.size(), size / MinPart), 1);
+		size_t partLen = (size + parts - 1) / parts;
 
-		if (g_DebugMode)
-			std::cout << " attempt #" << attempt << "\n";
+		for (size_t i = 0; i < parts; i++)
+		{
+			Connection *c = m_connections[first[r] + i];
+
+			c->start = request->offset + i * partLen;
+			c->len = std::min(partLen, size - i * partLen);
+			slice(request->iov, request->iovcnt, i * partLen, c->len, c->iov);
+			reset(c);
+			c->error = true;
+		}
+		first[r + 1] = first[r] + parts;
+	}
 
-		std::ostream request_stream(&m_request);
-		request_stream << "GET " << m_path << " HTTP/1.1\r\n";
-		request_stream << "Host: " << m_server << "\r\n";
-		request_stream << "Range: bytes=" << start << "-" << end << "\r\n\r\n";
+	fetch(first[requests.size()], stride);
 
-		if (g_DebugMode)
+	// Return data received in one piece from the start.
+	for (size_t r = 0; r < requests.size(); r++)
+	{
+		Request *request = requests[r];
+
+		request->result = 0;
+		request->error = 0;
+
+		for (size_t i = first[r]; i < first[r + 1]; i++)
 		{
-			std::cout << "\n";
-			std::cout << "GET " << m_path << " HTTP/1.1\n";
-			std::cout << "Host: " << m_server << "\n";
-			std::cout << "Range: bytes=" << start << "-" << end << "\n\n";
+			Connection *c = m_connections[i];
+
+			request->result += c->received;
+			if (c->error || (c->received < c->len))
+			{
+				// If error has been detected and we have read no data, return error code.
+				if (c->error && (request->result == 0))
+				{
+					request->result = -1;
+					request->error = m_aborted ? ECANCELED : ENOENT;
+				}
+				break;
+			}
 		}
+	}
+}
+
+Device::Request *DeviceHttp::complete(bool wait)
+{
+	// Requests that have not started are cancelled too.
+	if (cancelled())
+	{
+		while (!m_requests.empty())
+			Device::cancel(m_requests.front()->id);
+	}
 
-		if (m_closed)
+	// Submitted requests are fetched together by the pool when one
+	// is waited for, nothing is in flight between calls.
+	if (wait && m_completed.empty() && !m_requests.empty())
+	{
+		std::vector<Request *> remote;
+
+		while (!m_requests.empty())
 		{
-			if (g_DebugMode)
-				std::cout << "Performing reconect...\n";
+			Request *request = m_requests.front();
+			m_requests.pop_front();
 
-			// Start an asynchronous resolve to translate the server and
-			// service names into a list of endpoints.
-			boost::asio::ip::tcp::resolver::query query(m_server, "http");
-			m_resolver.async_resolve(query,
-						 boost::bind(&DeviceHttp::handleResolve,
-							     this,
-							     boost::asio::placeholders::error,
-							     boost::asio::placeholders::iterator));
+			// Beginning of the file is received already, a stream is
+			// read in order.
+			if (m_stream || (request->offset >= m_fileSize) || (length(request) == 0) ||
+			    (static_cast<size_t>(request->offset) < m_head.size()))
+			{
+				request->result = preadv(request->iov, request->iovcnt, request->offset);
+				request->error = (request->result == -1) ? errno : 0;
+				m_completed.push_back(request);
+				continue;
+			}
+			remote.push_back(request);
 		}
-		else
+
+		if (!remote.empty())
 		{
-			// Reuse old connected socket.
-			boost::system::error_code err;
-			handleConnect(err, boost::asio::ip::tcp::resolver::iterator());
+			fetchRequests(remote, (remote.size() == 1) ? length(remote[0]) : 0);
+			m_completed.insert(m_completed.end(), remote.begin(), remote.end());
 		}
+	}
+
+	return Device::complete(false);
+}
+
+void DeviceHttp::fetch(size_t parts, off_t stride)
+{
+	// Retries that receive some data don't count, failing ones
+	// wait before the next attempt for longer and longer time.
+	size_t retries = 0;
+	long backoff = InitialBackoff;
+
+	std::vector<size_t> received(parts);
+
+	// Cancellation of an earlier read doesn't hold.
+	__atomic_store_n(&m_cancelled, false, __ATOMIC_RELEASE);
+	m_aborted = false;
+
+	// Size of reads changes (adapted read size, small reads of data
+	// the reader waits for, end of file), don't queue until it
+	// settles.
+	m_stride = (stride == m_lastStride) ? stride : 0;
+	m_lastStride = stride;
+
+	while (true)
+	{
+		// Request parts that are not received yet.
+		bool pending = false;
+		for (size_t i = 0; i < parts; i++)
+		{
+			Connection *c = m_connections[i];
+
+			received[i] = c->received;
+
+			if (!c->error)
+				continue;
+			pending = true;
+
+			resume(c);
+		}
+		if (!pending)
+			break;
+
 		m_ioservice.reset();
 		m_ioservice.run();
 
-		if (!m_error)
+		// Dropping of a response failed.
+		for (size_t i = 0; i < parts; i++)
+			endSkip(m_connections[i]);
+
+		if (cancelled())
+		{
+			abort(parts);
+			break;
+		}
+
+		bool failed = false;
+		bool progress = false;
+		for (size_t i = 0; i < parts; i++)
+		{
+			if (m_connections[i]->error)
+			{
+				failed = true;
+				progress |= (m_connections[i]->received > received[i]);
+			}
+		}
+		if (!failed)
 			break;
+
+		if (progress)
+		{
+			backoff = InitialBackoff;
+			continue;
+		}
+
+		if (++retries > m_retries)
+			break;
+
+		if (g_DebugMode)
+			std::cout << " retry #" << retries << " in " << backoff << " ms\n";
+
+		wait(backoff);
+		backoff = (backoff * 2 < MaxBackoff) ? backoff * 2 : MaxBackoff;
+
+		// Nothing is in flight while waiting.
+		if (cancelled())
+		{
+			m_aborted = true;
+			break;
+		}
 	}
+}
 
-	// If error has been detected and we have read no data, return error code.
-	if ((attempt > 1) && (m_size == size))
-		return -1;
+/** Completion of a timer, nothing to do.
+**/
+static void expired(const boost::system::error_code& /*err*/)
+{
+}
+
+void DeviceHttp::wait(long ms)
+{
+	m_timer.expires_from_now(boost::posix_time::milliseconds(ms));
+	m_timer.async_wait(&expired);
 
-	return size - m_size;
+	m_ioservice.reset();
+	m_ioservice.run();
 }
 
 void DeviceHttp::parseUrl(const std::string url)
@@ -119,96 +560,569 @@ void DeviceHttp::parseUrl(const std::string url)
 	m_path = url.substr(t2);
 }
 
-void DeviceHttp::resolve()
+void DeviceHttp::reset(Connection *c)
+{
+	c->error = false;
+	c->contentLength = 0;
+	c->next = 0;
+	c->data = NULL;
+	c->size = 0;
+	c->received = 0;
+}
+
+/** Append request to the buffer, of ranges ("first-last,...") unless
+ *  they are empty.
+**/
+static void compose(boost::asio::streambuf& request, const char *method, const std::string& server, const std::string& path, const std::string& ranges)
+{
+	std::ostream request_stream(&request);
+	request_stream << method << " " << path << " HTTP/1.1\r\n";
+	request_stream << "Host: " << server << "\r\n";
+	if (!ranges.empty())
+		request_stream << "Range: bytes=" << ranges << "\r\n";
+	request_stream << "\r\n";
+
+	if (g_DebugMode)
+	{
+		std::cout << "\n";
+		std::cout << method << " " << path << " HTTP/1.1\n";
+		std::cout << "Host: " << server << "\n";
+		if (!ranges.empty())
+			std::cout << "Range: bytes=" << ranges << "\n";
+		std::cout << "\n";
+	}
+}
+
+/** Append GET request of ranges ("first-last,...") to the buffer.
+**/
+static void get(boost::asio::streambuf& request, const std::string& server, const std::string& path, const std::string& ranges)
+{
+	compose(request, "GET", server, path, ranges);
+}
+
+/** Append GET request of a range to the buffer.
+**/
+static void get(boost::asio::streambuf& request, const std::string& server, const std::string& path, off_t start, size_t len)
+{
+	std::ostringstream range;
+	range << start << "-" << (start + len - 1);
+
+	get(request, server, path, range.str());
+}
+
+/** Order extents by offset.
+**/
+static bool earlier(const Device::Extent *a, const Device::Extent *b)
+{
+	return a->offset < b->offset;
+}
+
+void DeviceHttp::preadExtents(Extent *extents, size_t count)
+{
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << " count: " << count << "\n";
+
+	std::vector<Extent *> pending;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		Extent& e = extents[i];
+
+		e.result = 0;
+		e.error = 0;
+
+		if ((e.offset >= m_fileSize) || (e.len == 0))
+			continue;
+
+		// Beginning of the file is received already by open().
+		if (static_cast<size_t>(e.offset) + e.len <= m_head.size())
+		{
+			memcpy(e.buf, &m_head[e.offset], e.len);
+			e.result = e.len;
+			continue;
+		}
+		pending.push_back(&e);
+	}
+
+	// Request several extents at once.
+	if (m_multiRange && (pending.size() > 1))
+	{
+		std::sort(pending.begin(), pending.end(), earlier);
+
+		for (size_t i = 0; i < pending.size(); i += MaxRanges)
+		{
+			std::vector<Extent *> group(pending.begin() + i,
+			                            pending.begin() + std::min(i + MaxRanges, pending.size()));
+			if (group.size() > 1)
+				fetchRanges(group);
+			if (m_aborted)
+				break;
+		}
+	}
+
+	// Extents that have not been received are read one by one,
+	// requests of a single range are retried.
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		Extent *e = pending[i];
+
+		if (e->result == std::min<off_t>(e->len, m_fileSize - e->offset))
+			continue;
+
+		// Extents are not wanted anymore once a read is cancelled.
+		if (m_aborted)
+		{
+			e->result = -1;
+			e->error = ECANCELED;
+			continue;
+		}
+
+		Device::preadExtents(e, 1);
+	}
+}
+
+void DeviceHttp::fetchRanges(std::vector<Extent *>& extents)
+{
+	Connection *c = m_connections[0];
+
+	// Merge overlapping and adjacent ranges, servers may refuse
+	// them.
+	std::ostringstream ranges;
+	off_t start = -1;
+	off_t end = -1;
+	for (size_t i = 0; i < extents.size(); i++)
+	{
+		Extent *e = extents[i];
+		off_t eEnd = e->offset + std::min<off_t>(e->len, m_fileSize - e->offset);
+
+		if ((start >= 0) && (e->offset <= end))
+		{
+			end = std::max(end, eEnd);
+			continue;
+		}
+		if (start >= 0)
+			ranges << start << "-" << (end - 1) << ",";
+
+		start = e->offset;
+		end = eEnd;
+	}
+	ranges << start << "-" << (end - 1);
+
+	// Responses to other ranges are queued, connect again instead.
+	if (!c->queued.empty())
+	{
+		c->queued.clear();
+		c->closed = true;
+	}
+
+	reset(c);
+	c->extents = &extents;
+	get(c->request, m_server, m_path, ranges.str());
+
+	__atomic_store_n(&m_cancelled, false, __ATOMIC_RELEASE);
+	m_aborted = false;
+
+	if (c->closed)
+		connect(c);
+	else
+		send(c);
+
+	m_ioservice.reset();
+	m_ioservice.run();
+
+	if (cancelled())
+		abort(1);
+
+	c->extents = NULL;
+	std::vector<char>().swap(c->body);
+}
+
+size_t DeviceHttp::queue(Connection *c, off_t stride)
+{
+	size_t added = 0;
+
+	if (stride == 0)
+		return 0;
+
+	// Requests of the following reads of the same size are likely to
+	// come, each connection serves the same part of them.
+	for (off_t start = c->start + (c->queued.size() + 1) * stride;
+	     (c->queued.size() + 1 < m_pipeline) && (start < m_fileSize);
+	     start += stride)
+	{
+		size_t len = std::min<off_t>(c->len, m_fileSize - start);
+
+		get(c->request, m_server, m_path, start, len);
+		c->queued.push_back(std::make_pair(start, len));
+		added++;
+	}
+	return added;
+}
+
+void DeviceHttp::resume(Connection *c)
+{
+	if ((c->received == 0) && !c->closed && !c->queued.empty())
+	{
+		std::pair<off_t, size_t> part(c->start, c->len);
+
+		// Response to the part is on its way already.
+		if (c->queued.front() == part)
+		{
+			c->queued.pop_front();
+			receive(c);
+
+			// Previous requests are written already.
+			if ((c->request.size() == 0) && (queue(c, m_stride) > 0))
+			{
+				boost::asio::async_write(*c->socket,
+				                         c->request,
+				                         boost::bind(&DeviceHttp::handleWriteQueued,
+				                                     this,
+				                                     c,
+				                                     boost::asio::placeholders::error));
+			}
+			return;
+		}
+
+		// Request the part behind responses to other ranges, they
+		// are dropped meanwhile.
+		if ((std::find(c->queued.begin(), c->queued.end(), part) == c->queued.end()) &&
+		    (c->request.size() == 0))
+		{
+			get(c->request, m_server, m_path, c->start, c->len);
+			c->queued.push_back(part);
+
+			boost::asio::async_write(*c->socket,
+			                         c->request,
+			                         boost::bind(&DeviceHttp::handleWriteQueued,
+			                                     this,
+			                                     c,
+			                                     boost::asio::placeholders::error));
+		}
+		skip(c);
+		return;
+	}
+
+	// Responses queued on a broken connection are lost.
+	if (!c->queued.empty())
+	{
+		c->queued.clear();
+		c->closed = true;
+	}
+
+	request(c, m_stride);
+}
+
+void DeviceHttp::skip(Connection *c)
+{
+	// Body is read to no destination buffers, that drops it.
+	c->skipping = true;
+	c->parked.swap(c->iov);
+	c->iov.clear();
+
+	reset(c);
+	c->requested = c->queued.front().first;
+	c->queued.pop_front();
+
+	if (g_DebugMode)
+		std::cout << "Dropping queued response\n";
+
+	boost::asio::async_read_until(*c->socket,
+	                              c->response,
+	                              "\r\n\r\n",
+	                              boost::bind(&DeviceHttp::handleReadHeaders,
+	                                          this,
+	                                          c,
+	                                          boost::asio::placeholders::error));
+}
+
+void DeviceHttp::endSkip(Connection *c)
+{
+	if (!c->skipping)
+		return;
+
+	// Part is requested again if the connection failed meanwhile.
+	bool error = c->error;
+
+	c->skipping = false;
+	c->iov.swap(c->parked);
+	reset(c);
+	c->error = error;
+}
+
+void DeviceHttp::receive(Connection *c)
 {
-	std::ostream request_stream(&m_request);
-	request_stream << "HEAD " << m_path << " HTTP/1.1\r\n";
-	request_stream << "Host: " << m_server << "\r\n\r\n";
+	reset(c);
+	c->requested = c->start;
 
 	if (g_DebugMode)
+		std::cout << "Receiving queued response\n";
+
+	// Read the response headers, they may be buffered already.
+	boost::asio::async_read_until(*c->socket,
+	                              c->response,
+	                              "\r\n\r\n",
+	                              boost::bind(&DeviceHttp::handleReadHeaders,
+	                                          this,
+	                                          c,
+	                                          boost::asio::placeholders::error));
+}
+
+void DeviceHttp::request(Connection *c, off_t stride)
+{
+	c->error = false;
+	c->contentLength = 0;
+
+	if (Connection::Ranges == c->kind)
+	{
+		// Continue where the previous attempt ended.
+		c->requested = c->start + c->received;
+		get(c->request, m_server, m_path, c->requested, c->len - c->received);
+		queue(c, stride);
+	}
+	else
 	{
-		std::cout << "\nHEAD " << m_path << " HTTP/1.1\n";
-		std::cout << "Host: " << m_server << "\n\n";
+		compose(c->request, (Connection::Headers == c->kind) ? "HEAD" : "GET", m_server, m_path, std::string());
 	}
 
+	if (c->closed)
+		connect(c);
+	else
+		send(c);  // Reuse old connected socket.
+}
+
+void DeviceHttp::connect(Connection *c)
+{
+	if (dropped(c))
+		return;
+
+	if (g_DebugMode)
+		std::cout << "Performing reconect...\n";
+
+	c->socket->close();
+	c->response.consume(c->response.size());
+
+	if (m_endpoints.empty())
+		resolve(c);
+	else
+		race(c);
+}
+
+void DeviceHttp::resolve(Connection *c)
+{
 	// Start an asynchronous resolve to translate the server and
 	// service names into a list of endpoints.
 	boost::asio::ip::tcp::resolver::query query(m_server, "http");
 	m_resolver.async_resolve(query,
 	                         boost::bind(&DeviceHttp::handleResolve,
 	                                     this,
+	                                     c,
 	                                     boost::asio::placeholders::error,
 	                                     boost::asio::placeholders::iterator));
 }
 
-void DeviceHttp::handleResolve(const boost::system::error_code& err,
-                                      boost::asio::ip::tcp::resolver::iterator endpoint_iterator)
+void DeviceHttp::handleResolve(Connection *c,
+                               const boost::system::error_code& err,
+                               boost::asio::ip::tcp::resolver::iterator endpoint_iterator)
+{
+	if (!err)
+	{
+		// Other connections may have resolved the server meanwhile.
+		if (m_endpoints.empty())
+		{
+			// Interleave address families, IPv6 first, so that
+			// a broken family doesn't delay the other one.
+			std::vector<boost::asio::ip::tcp::endpoint> v6, v4;
+			for (; endpoint_iterator != boost::asio::ip::tcp::resolver::iterator(); ++endpoint_iterator)
+			{
+				boost::asio::ip::tcp::endpoint endpoint = *endpoint_iterator;
+				if (endpoint.address().is_v6())
+					v6.push_back(endpoint);
+				else
+					v4.push_back(endpoint);
+			}
+			for (size_t i = 0; i < std::max(v6.size(), v4.size()); i++)
+			{
+				if (i < v6.size())
+					m_endpoints.push_back(v6[i]);
+				if (i < v4.size())
+					m_endpoints.push_back(v4[i]);
+			}
+		}
+
+		race(c);
+	}
+	else
+	{
+		if (g_DebugMode)
+			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+
+		c->error = true;
+		c->request.consume(c->request.size());
+		errno = ENOENT;
+	}
+}
+
+void DeviceHttp::race(Connection *c)
+{
+	if (dropped(c))
+		return;
+
+	// The endpoint that worked last time goes first.
+	c->order.clear();
+	if (std::find(m_endpoints.begin(), m_endpoints.end(), m_lastEndpoint) != m_endpoints.end())
+		c->order.push_back(m_lastEndpoint);
+	for (size_t i = 0; i < m_endpoints.size(); i++)
+	{
+		if (m_endpoints[i] != m_lastEndpoint)
+			c->order.push_back(m_endpoints[i]);
+	}
+
+	if (c->order.empty())
+	{
+		c->error = true;
+		c->request.consume(c->request.size());
+		errno = ENOENT;
+		return;
+	}
+
+	c->nextAttempt = 0;
+	c->connecting = true;
+	attempt(c);
+}
+
+void DeviceHttp::attempt(Connection *c)
+{
+	if (c->nextAttempt >= c->order.size())
+		return;
+
+	boost::asio::ip::tcp::endpoint endpoint = c->order[c->nextAttempt++];
+
+	if (g_DebugMode)
+		std::cout << "Connecting to " << endpoint << "\n";
+
+	boost::asio::ip::tcp::socket *socket = new boost::asio::ip::tcp::socket(m_ioservice);
+	c->attempts.push_back(socket);
+	socket->async_connect(endpoint,
+	                      boost::bind(&DeviceHttp::handleConnect,
+	                                  this,
+	                                  c,
+	                                  socket,
+	                                  endpoint,
+	                                  boost::asio::placeholders::error));
+
+	// Give the attempt a head start before the next one.
+	if (c->nextAttempt < c->order.size())
+	{
+		c->attemptTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(AttemptDelay)));
+		c->attemptTimer.async_wait(boost::bind(&DeviceHttp::handleAttemptDelay,
+		                                       this,
+		                                       c,
+		                                       boost::asio::placeholders::error));
+	}
+}
+
+void DeviceHttp::handleAttemptDelay(Connection *c, const boost::system::error_code& err)
+{
+	// Timer is cancelled when the race is decided or an attempt
+	// failed and the next one started already.
+	if (!err && c->connecting)
+		attempt(c);
+}
+
+void DeviceHttp::handleConnect(Connection *c,
+                               boost::asio::ip::tcp::socket *socket,
+                               boost::asio::ip::tcp::endpoint endpoint,
+                               const boost::system::error_code& err)
 {
-	if (!err)
+	c->attempts.erase(std::find(c->attempts.begin(), c->attempts.end(), socket));
+
+	if (!c->connecting)
 	{
-		// Attempt a connection to the first endpoint in the list. Each endpoint
-		// will be tried until we successfully establish a connection.
-		boost::asio::ip::tcp::endpoint endpoint = *endpoint_iterator;
-		m_socket.close();
-		m_socket.async_connect(endpoint,
-		                       boost::bind(&DeviceHttp::handleConnect,
-		                                   this,
-		                                   boost::asio::placeholders::error,
-		                                   ++endpoint_iterator));
+		// Race is decided already.
+		delete socket;
+		return;
 	}
-	else
+
+	if (!err)
 	{
-		if (g_DebugMode)
-			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+		// The connection was successful, drop other attempts.
+		c->connecting = false;
+		c->attemptTimer.cancel();
+		for (size_t i = 0; i < c->attempts.size(); i++)
+			c->attempts[i]->close();
 
-		m_error = true;
-		errno = ENOENT;
+		delete c->socket;
+		c->socket = socket;
+		m_lastEndpoint = endpoint;
+
+		send(c);
+		return;
 	}
-}
 
-void DeviceHttp::handleConnect(const boost::system::error_code& err,
-                               boost::asio::ip::tcp::resolver::iterator endpoint_iterator)
-{
-	if (!err)
+	if (g_DebugMode)
+		std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+
+	delete socket;
+
+	if (c->nextAttempt < c->order.size())
 	{
-		// The connection was successful. Send the request.
-		boost::asio::async_write(m_socket,
-		                         m_request,
-		                         boost::bind(&DeviceHttp::handleWriteRequest,
-		                                     this,
-		                                     boost::asio::placeholders::error));
+		// The connection failed. Don't wait for the next endpoint.
+		c->attemptTimer.cancel();
+		attempt(c);
 	}
-	else if (endpoint_iterator != boost::asio::ip::tcp::resolver::iterator())
+	else if (c->attempts.empty())
 	{
-		// The connection failed. Try the next endpoint in the list.
-		m_socket.close();
-		boost::asio::ip::tcp::endpoint endpoint = *endpoint_iterator;
-		m_socket.async_connect(endpoint,
-		                       boost::bind(&DeviceHttp::handleConnect,
-		                                   this,
-		                                   boost::asio::placeholders::error,
-		                                   ++endpoint_iterator));
+		// All endpoints failed, resolve the server again next time.
+		c->connecting = false;
+		m_endpoints.clear();
+
+		c->error = true;
+		c->closed = true;
+		c->request.consume(c->request.size());
+		errno = ENOENT;
 	}
-	else
+}
+
+void DeviceHttp::send(Connection *c)
+{
+	if (dropped(c))
+		return;
+
+	boost::asio::async_write(*c->socket,
+	                         c->request,
+	                         boost::bind(&DeviceHttp::handleWriteRequest,
+	                                     this,
+	                                     c,
+	                                     boost::asio::placeholders::error));
+}
+
+void DeviceHttp::handleWriteQueued(Connection *c, const boost::system::error_code& err)
+{
+	if (err)
 	{
 		if (g_DebugMode)
 			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
 
-		m_error = true;
-		errno = ENOENT;
+		// Response to the current request fails too, it is
+		// requested again.
+		c->closed = true;
+		c->queued.clear();
+		c->request.consume(c->request.size());
 	}
 }
 
-void DeviceHttp::handleWriteRequest(const boost::system::error_code& err)
+void DeviceHttp::handleWriteRequest(Connection *c, const boost::system::error_code& err)
 {
 	if (!err)
 	{
 		// Read the response headers.
-		boost::asio::async_read_until(m_socket,
-		                              m_response,
+		boost::asio::async_read_until(*c->socket,
+		                              c->response,
 		                              "\r\n\r\n",
 		                              boost::bind(&DeviceHttp::handleReadHeaders,
 		                                          this,
+		                                          c,
 		                                          boost::asio::placeholders::error));
 	}
 	else
@@ -216,17 +1130,19 @@ void DeviceHttp::handleWriteRequest(const boost::system::error_code& err)
 		if (g_DebugMode)
 			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
 
-		m_error = true;
+		c->error = true;
+		c->closed = true;
+		c->request.consume(c->request.size());
 		errno = ENOENT;
 	}
 }
 
-void DeviceHttp::handleReadHeaders(const boost::system::error_code& err)
+void DeviceHttp::handleReadHeaders(Connection *c, const boost::system::error_code& err)
 {
 	if (!err)
 	{
 		// Check that response is OK.
-		std::istream response_stream(&m_response);
+		std::istream response_stream(&c->response);
 		std::string http_version;
 		response_stream >> http_version;
 		unsigned int status_code;
@@ -234,15 +1150,23 @@ void DeviceHttp::handleReadHeaders(const boost::system::error_code& err)
 		std::string status_message;
 		std::getline(response_stream, status_message);
 		if (!response_stream || http_version.substr(0, 5) != "HTTP/")
+		{
+			c->error = true;
+			c->closed = true;
+			errno = ENOENT;
 			return;
+		}
 
 		// Process the response headers.
 		std::string header;
 		std::string location;
 		std::string contentLength;
+		std::string contentRange;
+		std::string contentType;
+		bool chunked = false;
 
 		// We require HTTP/1.1 so default is keep-alive...
-		m_closed = false;
+		c->closed = false;
 
 		if (g_DebugMode)
 			std::cout << "\n";
@@ -257,31 +1181,82 @@ void DeviceHttp::handleReadHeaders(const boost::system::error_code& err)
 				location = header.substr(10, header.size() - 10 - 1);
 			if (strncasecmp(header.c_str(), "Content-Length: ", 16) == 0)
 				contentLength = header.substr(16, header.size() - 16 - 1);
+			if (strncasecmp(header.c_str(), "Content-Range: bytes ", 21) == 0)
+				contentRange = header.substr(21, header.size() - 21 - 1);
+			if (strncasecmp(header.c_str(), "Transfer-Encoding: chunked", 26) == 0)
+				chunked = true;
+			if (strncasecmp(header.c_str(), "Content-Type: ", 14) == 0)
+				contentType = header.substr(14, header.size() - 14 - 1);
 			if (strncasecmp(header.c_str(), "Connection: close", 17) == 0)
-				m_closed = true;
+			{
+				// Queued requests are lost, don't queue them anymore.
+				c->closed = true;
+				c->queued.clear();
+				m_pipeline = 1;
+			}
+			if (strncasecmp(header.c_str(), "ETag: ", 6) == 0)
+				m_etag = header.substr(6, header.size() - 6 - 1);
+			if (strncasecmp(header.c_str(), "Last-Modified: ", 15) == 0)
+				m_lastModified = header.substr(15, header.size() - 15 - 1);
 		}
 
 		if (g_DebugMode)
 			std::cout << "\n";
 
-		if (200 == status_code)
+		// Content range is "first-last/total" or "*/total".
+		off_t first = -1;
+		off_t total = -1;
+		if (!contentRange.empty())
 		{
-			// Success HEADER response, read total file size from content length.
-			if (0 == m_fileSize)
+			size_t slash = contentRange.find('/');
+			if ((contentRange[0] != '*') && (slash != std::string::npos))
+				first = atoll(contentRange.c_str());
+			if ((slash != std::string::npos) && (contentRange[slash + 1] != '*'))
+				total = atoll(contentRange.c_str() + slash + 1);
+		}
+
+		if ((Connection::Headers == c->kind) && (200 == status_code))
+		{
+			// Size of the file streamed with unknown length.
+			if (!contentLength.empty())
 				m_fileSize = boost::lexical_cast<off_t>(contentLength);
 		}
-		else if (206 == status_code)
+		else if ((Connection::Whole == c->kind) && (200 == status_code))
+		{
+			// Stream is open again.
+			startStream(contentLength, chunked);
+		}
+		else if ((NULL != c->extents) && (206 == status_code) && !contentLength.empty())
+		{
+			// Response to a request of several ranges.
+			c->contentLength = boost::lexical_cast<off_t>(contentLength);
+			readBatch(c, contentType, first);
+		}
+		else if ((206 == status_code) && (first == c->requested))
+		{
+			// Success partial GET, read total file size from content
+			// range (first request) and content length.
+			if ((0 == m_fileSize) && (total >= 0))
+				m_fileSize = total;
+
+			c->contentLength = boost::lexical_cast<off_t>(contentLength);
+
+			// Store data received with headers and read remaining ones.
+			storeBuffered(c);
+			readContent(c);
+		}
+		else if ((200 == status_code) && (0 == m_fileSize) && (0 == c->requested))
 		{
-			// Success partial GET, read content length.
-			m_contentLength = boost::lexical_cast<off_t>(contentLength);
+			// Server ignores ranges, the file is read as a stream,
+			// body of the response is the whole file.
+			if (g_DebugMode)
+				std::cout << "Server ignores ranges, streaming\n";
 
-			// Start reading remaining data.
-			boost::asio::async_read(m_socket,
-			                        m_response,
-			                        boost::asio::transfer_at_least(1),
-			                        boost::bind(&DeviceHttp::handleReadContent,
-			                                    this,
-			                                    boost::asio::placeholders::error));
+			startStream(contentLength, chunked);
+		}
+		else if ((416 == status_code) && (0 == m_fileSize) && (total == 0))
+		{
+			// Empty file has no range.
 		}
 		else if ((status_code >= 300) && (status_code < 400) && !location.empty())
 		{
@@ -292,15 +1267,41 @@ void DeviceHttp::handleReadHeaders(const boost::system::error_code& err)
 			// Create an absolute path if relative is given.
 			if (strncasecmp(location.c_str(), "http://", 7) != 0)
 				location = "http://" + m_server + location;
+			std::string server = m_server;
 			parseUrl(location);
-			resolve();
+			if (m_server != server)
+				m_endpoints.clear();
+
+			// Other connections lead to the old location.
+			for (size_t i = 0; i < m_connections.size(); i++)
+			{
+				m_connections[i]->closed = true;
+				m_connections[i]->queued.clear();
+			}
+
+			// Extents are requested one by one from the new
+			// location.
+			if (NULL != c->extents)
+			{
+				c->error = true;
+				c->closed = true;
+			}
+			else
+			{
+				request(c, 0);
+			}
 		}
 		else
 		{
 			if (g_DebugMode)
 				std::cout << "Response returned with status code " << status_code << "\n";
 
-			m_error = true;
+			// Server sends the whole file instead of ranges.
+			if ((NULL != c->extents) && (200 == status_code))
+				m_multiRange = false;
+
+			c->error = true;
+			c->closed = true;
 			errno = ENOENT;
 		}
 	}
@@ -309,39 +1310,544 @@ void DeviceHttp::handleReadHeaders(const boost::system::error_code& err)
 		if (g_DebugMode)
 			std::cout << "Error: " << err.message() << err << " / " << __PRETTY_FUNCTION__ << "\n";
 
-		m_error = true;
+		c->error = true;
+		c->closed = true;
+		errno = ENOENT;
+	}
+}
+
+void DeviceHttp::advance(Connection *c, size_t n)
+{
+	c->contentLength -= n;
+
+	while (n > 0)
+	{
+		// Move to the next destination buffer.
+		if (c->size == 0)
+		{
+			c->data = static_cast<char *>(c->iov[c->next].iov_base);
+			c->size = c->iov[c->next].iov_len;
+			c->next++;
+			continue;
+		}
+
+		size_t k = std::min(n, c->size);
+		c->data += k;
+		c->size -= k;
+		c->received += k;
+		n -= k;
+	}
+}
+
+void DeviceHttp::storeBuffered(Connection *c)
+{
+	// Write data of the response read together with headers, data that
+	// follow belong to the next queued response.
+	while ((c->response.size() > 0) && (c->contentLength > 0))
+	{
+		// Move to the next destination buffer.
+		if ((c->size == 0) && (c->next < c->iov.size()))
+		{
+			c->data = static_cast<char *>(c->iov[c->next].iov_base);
+			c->size = c->iov[c->next].iov_len;
+			c->next++;
+			continue;
+		}
+
+		// Server sent more than we asked for, drop it.
+		if (c->size == 0)
+		{
+			size_t n = std::min<off_t>(c->response.size(), c->contentLength);
+			c->response.consume(n);
+			c->contentLength -= n;
+			continue;
+		}
+
+		size_t n = std::min<off_t>(std::min(c->response.size(), c->size), c->contentLength);
+		c->response.sgetn(c->data, n);
+		advance(c, n);
+	}
+}
+
+void DeviceHttp::readContent(Connection *c)
+{
+	if (c->contentLength == 0)
+	{
+		// Dropped response is over, receive the part.
+		if (c->skipping && !c->error)
+		{
+			endSkip(c);
+			resume(c);
+		}
+		return;
+	}
+
+	// Read the rest of the body directly to destination buffers.
+	std::vector<boost::asio::mutable_buffer> buffers;
+	size_t len = 0;
+
+	if (c->size > 0)
+	{
+		len = std::min<off_t>(c->size, c->contentLength);
+		buffers.push_back(boost::asio::buffer(c->data, len));
+	}
+	for (size_t i = c->next; (i < c->iov.size()) && (len < static_cast<size_t>(c->contentLength)); i++)
+	{
+		size_t n = std::min<off_t>(c->iov[i].iov_len, c->contentLength - len);
+		buffers.push_back(boost::asio::buffer(c->iov[i].iov_base, n));
+		len += n;
+	}
+
+	if (!buffers.empty())
+	{
+		boost::asio::async_read(*c->socket,
+		                        buffers,
+		                        boost::bind(&DeviceHttp::handleReadContent,
+		                                    this,
+		                                    c,
+		                                    boost::asio::placeholders::error,
+		                                    boost::asio::placeholders::bytes_transferred));
+	}
+	else
+	{
+		// Server sends more than we asked for, read it to drop it.
+		boost::asio::async_read(*c->socket,
+		                        c->response,
+		                        boost::asio::transfer_exactly(std::min<off_t>(c->contentLength, MaxResponse)),
+		                        boost::bind(&DeviceHttp::handleReadBuffered,
+		                                    this,
+		                                    c,
+		                                    boost::asio::placeholders::error));
+	}
+}
+
+void DeviceHttp::handleReadContent(Connection *c, const boost::system::error_code& err, size_t transferred)
+{
+	// Keep data received before an error.
+	advance(c, transferred);
+
+	if (!err)
+	{
+		readContent(c);
+	}
+	else
+	{
+		if (g_DebugMode)
+			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+
+		c->error = true;
+		c->closed = true;
+		errno = ENOENT;
+	}
+}
+
+void DeviceHttp::handleReadBuffered(Connection *c, const boost::system::error_code& err)
+{
+	if (!err)
+	{
+		storeBuffered(c);
+		readContent(c);
+	}
+	else
+	{
+		if (g_DebugMode)
+			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+
+		c->error = true;
+		c->closed = true;
+		errno = ENOENT;
+	}
+}
+
+void DeviceHttp::readBatch(Connection *c, const std::string& contentType, off_t first)
+{
+	size_t b = contentType.find("boundary=");
+
+	if ((strncasecmp(contentType.c_str(), "multipart/byteranges", 20) == 0) && (b != std::string::npos))
+	{
+		// Boundary may be quoted and followed by other parameters.
+		std::string boundary = contentType.substr(b + 9);
+		if (!boundary.empty() && (boundary[0] == '"'))
+			boundary = boundary.substr(1, boundary.find('"', 1) - 1);
+		else
+			boundary = boundary.substr(0, boundary.find(';'));
+
+		c->boundary = "--" + boundary;
+	}
+	else if (first >= 0)
+	{
+		// Server merged the ranges to a single one.
+		c->boundary.clear();
+		c->start = first;
+	}
+	else
+	{
+		c->error = true;
+		c->closed = true;
 		errno = ENOENT;
-		if (err == boost::asio::error::eof)
-			m_closed = true;
+		return;
+	}
+
+	// Body is small (a bunch of small extents), it is read whole
+	// and split to parts then.
+	c->body.resize(c->contentLength);
+	size_t n = std::min<off_t>(c->response.size(), c->contentLength);
+	if (n > 0)
+		c->response.sgetn(&c->body[0], n);
+
+	if (n < c->body.size())
+	{
+		boost::asio::async_read(*c->socket,
+		                        boost::asio::buffer(&c->body[n], c->body.size() - n),
+		                        boost::bind(&DeviceHttp::handleReadBatch,
+		                                    this,
+		                                    c,
+		                                    boost::asio::placeholders::error));
+	}
+	else
+	{
+		handleReadBatch(c, boost::system::error_code());
 	}
 }
 
-void DeviceHttp::handleReadContent(const boost::system::error_code& err)
+void DeviceHttp::handleReadBatch(Connection *c, const boost::system::error_code& err)
 {
 	if (!err)
 	{
-		// Write all of the data that has been read so far.
-		std::ostrstream out(m_data, m_size);
-		m_data += m_response.size();
-		m_size -= m_response.size();
-		m_contentLength -= m_response.size();
-		out << &m_response;
+		if (!c->boundary.empty())
+		{
+			if (!parseParts(c))
+			{
+				if (g_DebugMode)
+					std::cout << "Malformed multipart response\n";
 
-		// Continue reading remaining data if we expect it.
-		if (m_contentLength > 0)
+				c->error = true;
+				errno = ENOENT;
+			}
+		}
+		else if (!c->body.empty())
 		{
-			boost::asio::async_read(m_socket,
-			                        m_response,
-			                        boost::asio::transfer_at_least(1),
-			                        boost::bind(&DeviceHttp::handleReadContent,
-			                                    this,
-			                                    boost::asio::placeholders::error));
+			place(c, c->start, &c->body[0], c->body.size());
 		}
 	}
 	else
 	{
 		if (g_DebugMode)
 			std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+
+		c->error = true;
+		c->closed = true;
+		errno = ENOENT;
+	}
+}
+
+bool DeviceHttp::parseParts(Connection *c)
+{
+	static const char separator[] = "\r\n\r\n";
+
+	const char *body = c->body.empty() ? NULL : &c->body[0];
+	const char *end = body + c->body.size();
+	const char *p = body;
+
+	while (true)
+	{
+		// Find delimiter of the next part.
+		p = std::search(p, end, c->boundary.begin(), c->boundary.end());
+		if (p == end)
+			return false;
+		p += c->boundary.size();
+
+		// Closing delimiter ends the body.
+		if ((end - p >= 2) && (p[0] == '-') && (p[1] == '-'))
+			return true;
+
+		// Headers of the part, data follow.
+		const char *data = std::search(p, end, separator, separator + 4);
+		if (data == end)
+			return false;
+
+		std::istringstream headers(std::string(p, data));
+		std::string header;
+		off_t first = -1;
+		off_t last = -1;
+
+		while (std::getline(headers, header))
+		{
+			if (strncasecmp(header.c_str(), "Content-Range: bytes ", 21) == 0)
+			{
+				size_t dash = header.find('-', 21);
+				first = atoll(header.c_str() + 21);
+				if (dash != std::string::npos)
+					last = atoll(header.c_str() + dash + 1);
+			}
+		}
+
+		data += 4;
+		if ((first < 0) || (last < first) || (last - first + 1 > end - data))
+			return false;
+
+		place(c, first, data, last - first + 1);
+		p = data + (last - first + 1);
+	}
+}
+
+void DeviceHttp::place(Connection *c, off_t offset, const char *data, size_t len)
+{
+	for (size_t i = 0; i < c->extents->size(); i++)
+	{
+		Extent *e = (*c->extents)[i];
+		off_t from = std::max(offset, e->offset);
+		off_t to = std::min<off_t>(offset + len, e->offset + e->len);
+
+		if (from >= to)
+			continue;
+
+		memcpy(e->buf + (from - e->offset), data + (from - offset), to - from);
+		e->result += to - from;
+	}
+}
+
+void DeviceHttp::startStream(const std::string& contentLength, bool chunked)
+{
+	m_stream = true;
+	m_streamOpen = true;
+	m_streamOffset = 0;
+	m_multiRange = false;
+
+	m_chunked = chunked;
+	m_chunkLeft = 0;
+	m_bodyLeft = (chunked || contentLength.empty()) ? -1 : boost::lexical_cast<off_t>(contentLength);
+
+	if ((0 == m_fileSize) && (m_bodyLeft >= 0))
+		m_fileSize = m_bodyLeft;
+}
+
+bool DeviceHttp::openStream()
+{
+	Connection *c = m_connections[0];
+
+	if (g_DebugMode)
+		std::cout << "Opening stream\n";
+
+	// Rest of the old body is not read, connect again.
+	c->kind = Connection::Whole;
+	c->closed = true;
+	c->queued.clear();
+	m_streamOpen = false;
+
+	reset(c);
+	c->error = true;
+
+	fetch(1, 0);
+
+	return !c->error && m_streamOpen;
+}
+
+ssize_t DeviceHttp::streamRead(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	size_t done = 0;
+	size_t failures = 0;
+	bool failed = false;
+
+	int i = 0;
+	size_t filled = 0;
+
+	while (i < iovcnt)
+	{
+		if (filled == iov[i].iov_len)
+		{
+			i++;
+			filled = 0;
+			continue;
+		}
+
+		off_t position = offset + done;
+
+		// Backward seek or interrupted stream, request the whole
+		// file again.
+		if (!m_streamOpen || (m_streamOffset > position))
+		{
+			if (!openStream())
+			{
+				failed = true;
+				break;
+			}
+		}
+
+		ssize_t r;
+		if (m_streamOffset < position)
+		{
+			// Forward seek, skip data.
+			r = streamBody(NULL, position - m_streamOffset);
+		}
+		else
+		{
+			r = streamBody(static_cast<char *>(iov[i].iov_base) + filled, iov[i].iov_len - filled);
+			if (r > 0)
+			{
+				filled += r;
+				done += r;
+			}
+		}
+
+		if (r == 0)
+			break;
+
+		if (r == -1)
+		{
+			m_streamOpen = false;
+			if (++failures > m_retries)
+			{
+				failed = true;
+				break;
+			}
+		}
+	}
+
+	if (failed && (done == 0))
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	return done;
+}
+
+ssize_t DeviceHttp::streamBody(char *buf, size_t len)
+{
+	Connection *c = m_connections[0];
+
+	// Chunk starts by a line with its size, the previous chunk
+	// ends by an empty line.
+	while (m_chunked && (m_chunkLeft == 0) && (m_bodyLeft != 0))
+	{
+		if (!streamReceive(c, true))
+			return -1;
+
+		std::istream stream(&c->response);
+		std::string line;
+		std::getline(stream, line);
+
+		if (line.empty() || (line == "\r"))
+			continue;
+		if (!isxdigit(line[0]))
+			return -1;
+
+		m_chunkLeft = strtoll(line.c_str(), NULL, 16);
+		if (m_chunkLeft == 0)
+		{
+			// The last chunk, trailers are not read.
+			m_bodyLeft = 0;
+			c->closed = true;
+		}
+	}
+
+	if (m_bodyLeft == 0)
+		return 0;
+
+	if (m_chunked)
+		len = std::min<off_t>(len, m_chunkLeft);
+	if (m_bodyLeft > 0)
+		len = std::min<off_t>(len, m_bodyLeft);
+
+	size_t n;
+	if (c->response.size() > 0)
+	{
+		// Data received with headers or a chunk size.
+		n = std::min(len, c->response.size());
+		if (buf != NULL)
+			c->response.sgetn(buf, n);
+		else
+			c->response.consume(n);
 	}
+	else if (buf != NULL)
+	{
+		// Read directly to destination.
+		c->error = false;
+		c->received = 0;
+		c->socket->async_read_some(boost::asio::buffer(buf, len),
+		                           boost::bind(&DeviceHttp::handleReadStream,
+		                                       this,
+		                                       c,
+		                                       boost::asio::placeholders::error,
+		                                       boost::asio::placeholders::bytes_transferred));
+		runStream();
+
+		if (c->error)
+			return -1;
+		n = c->received;
+	}
+	else
+	{
+		if (!streamReceive(c, false))
+			return -1;
+		n = std::min(len, c->response.size());
+		c->response.consume(n);
+	}
+
+	// Body without length ended.
+	if (m_bodyLeft == 0)
+		return 0;
+
+	m_streamOffset += n;
+	if (m_chunked)
+		m_chunkLeft -= n;
+	if (m_bodyLeft > 0)
+		m_bodyLeft -= n;
+
+	return n;
+}
+
+bool DeviceHttp::streamReceive(Connection *c, bool line)
+{
+	c->error = false;
+
+	if (line)
+	{
+		boost::asio::async_read_until(*c->socket,
+		                              c->response,
+		                              "\r\n",
+		                              boost::bind(&DeviceHttp::handleReadStream,
+		                                          this,
+		                                          c,
+		                                          boost::asio::placeholders::error,
+		                                          boost::asio::placeholders::bytes_transferred));
+	}
+	else
+	{
+		boost::asio::async_read(*c->socket,
+		                        c->response,
+		                        boost::asio::transfer_at_least(1),
+		                        boost::bind(&DeviceHttp::handleReadStream,
+		                                    this,
+		                                    c,
+		                                    boost::asio::placeholders::error,
+		                                    boost::asio::placeholders::bytes_transferred));
+	}
+
+	runStream();
+
+	return !c->error;
 }
 
+void DeviceHttp::handleReadStream(Connection *c, const boost::system::error_code& err, size_t transferred)
+{
+	c->received = transferred;
+
+	if (!err)
+		return;
+
+	// Body without length ends when the server closes connection.
+	if ((boost::asio::error::eof == err) && !m_chunked && (m_bodyLeft < 0))
+	{
+		m_bodyLeft = 0;
+		c->closed = true;
+		return;
+	}
+
+	if (g_DebugMode)
+		std::cout << "Error: " << err.message() << " / " << __PRETTY_FUNCTION__ << "\n";
+
+	c->error = true;
+	c->closed = true;
+	errno = ENOENT;
+}
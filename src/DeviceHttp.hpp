@@ -3,48 +3,357 @@
 
 #include "Device.hpp"
 #include <string>
+#include <vector>
+#include <deque>
 #include <boost/asio.hpp>
 
 class DeviceHttp : public Device
 {
 public:
-	DeviceHttp();
+	DeviceHttp(const Options& options);
+	~DeviceHttp();
 	bool open(const char *name);
 	ssize_t pread(char *buf, size_t len, off_t offset);
+	ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset);
+	void preadExtents(Extent *extents, size_t count);
 	off_t size();
 	void cancel();
+	using Device::cancel;
+	std::string version();
+	bool sequential() const;
+	Device *clone() const;
+
+	// Submitted requests are fetched together when one is waited
+	// for, nothing is on the wire between calls. The device is not
+	// asynchronous() then, reads in flight are kept by threads each
+	// with its own copy of the device.
+	//
+	Request *complete(bool wait);
 
 private:
-	void resolve();
-	void handleReadHeaders(const boost::system::error_code& err);
-	void handleWriteRequest(const boost::system::error_code& err);
-	void handleConnect(const boost::system::error_code& err, boost::asio::ip::tcp::resolver::iterator endpoint_iterator);
-	void handleResolve(const boost::system::error_code& err, boost::asio::ip::tcp::resolver::iterator endpoint_iterator);
-	void handleReadContent(const boost::system::error_code& err);
+	// Keep-alive connection to the server and state of the request
+	// it serves.
+	//
+	struct Connection
+	{
+		Connection(boost::asio::io_service& ioservice);
+		~Connection();
+
+		// Request of ranges of the file, of the whole file (stream) or
+		// of headers only.
+		//
+		enum Kind { Ranges, Whole, Headers };
+		Kind kind;
+
+		// Socket of the established connection, replaced by the socket
+		// of the attempt that wins a connection race.
+		//
+		boost::asio::ip::tcp::socket   *socket;
+		boost::asio::streambuf          request;
+		boost::asio::streambuf          response;
+
+		off_t  contentLength;
+
+		// Range requested and destination buffers for it; data is the
+		// buffer that is currently filled and size its remaining size.
+		//
+		off_t  start;
+		size_t len;
+
+		// Offset the current response is expected to start at.
+		//
+		off_t  requested;
+
+		std::vector<struct iovec> iov;
+		size_t next;
+		char  *data;
+		size_t size;
+
+		// Number of bytes stored to destination buffers.
+		//
+		size_t received;
+
+		// If true, error has been detected.
+		//
+		bool error;
+
+		// If true, connection is closed and must be established again.
+		//
+		bool closed;
+
+		// Ranges (start, length) requested in advance, their responses
+		// follow the response to the current request.
+		//
+		std::deque<std::pair<off_t, size_t> > queued;
+
+		// If true, response to a queued range that is not wanted
+		// anymore is being read and dropped, destination buffers of
+		// the current request are kept in parked meanwhile.
+		//
+		bool skipping;
+		std::vector<struct iovec> parked;
+
+		// Connection race: endpoints in order of attempts,
+		// the next one to attempt, sockets of attempts in progress and
+		// timer that starts the next attempt. If connecting is false,
+		// the race is decided and late attempts are dropped.
+		//
+		std::vector<boost::asio::ip::tcp::endpoint> order;
+		size_t nextAttempt;
+		std::vector<boost::asio::ip::tcp::socket *> attempts;
+		boost::asio::deadline_timer attemptTimer;
+		bool connecting;
+
+		// Extents requested by a multi-range request, NULL if the
+		// request is of a single range. Body of the response is read
+		// to body, boundary separates its parts (empty if the server
+		// sent a single range starting at start).
+		//
+		std::vector<Extent *> *extents;
+		std::vector<char> body;
+		std::string boundary;
+	};
+
+	// Establish the connection again, resolve the server unless its
+	// endpoints are known.
+	//
+	void connect(Connection *c);
+	void resolve(Connection *c);
+
+	// Race connection attempts to endpoints, the next attempt starts
+	// after AttemptDelay or as soon as an attempt fails.
+	//
+	void race(Connection *c);
+	void attempt(Connection *c);
+	void handleAttemptDelay(Connection *c, const boost::system::error_code& err);
+
+	// Send the request on the connected socket.
+	//
+	void send(Connection *c);
+	void reset(Connection *c);
+	void request(Connection *c, off_t stride);
+	void receive(Connection *c);
+
+	// Receive the part of connection, by the queued response if it
+	// is on its way, otherwise request it. Queued responses to other
+	// ranges are dropped first, the connection is kept.
+	//
+	void resume(Connection *c);
+
+	// Read and drop the first queued response, then resume().
+	//
+	void skip(Connection *c);
+	void endSkip(Connection *c);
+
+	// Append requests of ranges following the current one (stride
+	// bytes apart) to the request buffer up to pipeline depth.
+	// Return number of requests added.
+	//
+	size_t queue(Connection *c, off_t stride);
+	void handleWriteQueued(Connection *c, const boost::system::error_code& err);
+	void handleReadHeaders(Connection *c, const boost::system::error_code& err);
+	void handleWriteRequest(Connection *c, const boost::system::error_code& err);
+	void handleConnect(Connection *c, boost::asio::ip::tcp::socket *socket, boost::asio::ip::tcp::endpoint endpoint, const boost::system::error_code& err);
+	void handleResolve(Connection *c, const boost::system::error_code& err, boost::asio::ip::tcp::resolver::iterator endpoint_iterator);
+	void handleReadContent(Connection *c, const boost::system::error_code& err, size_t transferred);
+	void handleReadBuffered(Connection *c, const boost::system::error_code& err);
+	void handleReadBatch(Connection *c, const boost::system::error_code& err);
+	void handleReadStream(Connection *c, const boost::system::error_code& err, size_t transferred);
+
+	// Request extents (sorted by offset) in one request of several
+	// ranges. Extents that are not received stay with result 0.
+	//
+	void fetchRanges(std::vector<Extent *>& extents);
+
+	// Fetch reads of several requests at once, connections are split
+	// among them and the pool grows to have options.connections for
+	// each of them. Requests of following parts (stride bytes apart)
+	// may be queued.
+	//
+	void fetchRequests(const std::vector<Request *>& requests, off_t stride);
+
+	// Read body of a response to a multi-range request.
+	//
+	void readBatch(Connection *c, const std::string& contentType, off_t first);
+
+	// Split multipart/byteranges body to its parts.
+	// Return false if the body is malformed.
+	//
+	bool parseParts(Connection *c);
+
+	// Copy data of the file at offset to the requested extents.
+	//
+	void place(Connection *c, off_t offset, const char *data, size_t len);
+
+	// Take body of a response to a request of the whole file as the
+	// stream.
+	//
+	void startStream(const std::string& contentLength, bool chunked);
+
+	// Request the whole file again, the stream is at offset 0 then.
+	//
+	bool openStream();
+
+	// Read data of the stream at offset, skip data before it.
+	//
+	ssize_t streamRead(const struct iovec *iov, int iovcnt, off_t offset);
+
+	// Read at most len bytes of the body to buf (skip them if buf is
+	// NULL). Return number of bytes, 0 at the end of body or -1.
+	//
+	ssize_t streamBody(char *buf, size_t len);
+
+	// Receive more data of the stream to response of connection,
+	// a line if line is true.
+	//
+	bool streamReceive(Connection *c, bool line);
+
+	// Account n bytes stored at the current destination buffer.
+	//
+	void advance(Connection *c, size_t n);
+
+	// Store body data buffered in response, they come with headers.
+	//
+	void storeBuffered(Connection *c);
+
+	// Read the rest of the body.
+	//
+	void readContent(Connection *c);
 	void parseUrl(const std::string url);
 
+	// Fetch parts assigned to first parts connections, retry failed
+	// ones. Requests of following parts (stride bytes apart) may be
+	// queued.
+	//
+	void fetch(size_t parts, off_t stride);
+
+	// Wait before the next attempt of a failed request.
+	//
+	void wait(long ms);
+
+	// Take cancellation requested by cancel().
+	//
+	bool cancelled();
+
+	// Abort requests of first parts connections after cancellation,
+	// the connections are closed.
+	//
+	void abort(size_t parts);
+
+	// Fail starting operation of connection if requests have been
+	// aborted. Return true if so.
+	//
+	bool dropped(Connection *c);
+
+	// Run operations of the stream until they complete, they are not
+	// cancelled.
+	//
+	void runStream();
+
+	// Smallest part of a read served by its own connection.
+	//
+	static const size_t MinPart = 128 * 1024;
+
+	// Maximal size of data buffered in response of a connection,
+	// body of response is read directly to destination buffers.
+	//
+	static const size_t MaxResponse = 64 * 1024;
+
+	// Size of the beginning of the file requested by open().
+	//
+	static const size_t HeadSize = 64 * 1024;
+
+	// Maximal number of ranges in one request, servers limit it.
+	//
+	static const size_t MaxRanges = 32;
+
+	// Delay of the first retry and maximal delay in milliseconds.
+	//
+	static const long InitialBackoff = 100;
+	static const long MaxBackoff = 10000;
+
+	// Delay between starts of connection attempts in milliseconds
+	// (RFC 8305).
+	//
+	static const long AttemptDelay = 250;
+
 	boost::asio::io_service         m_ioservice;
 	boost::asio::ip::tcp::resolver  m_resolver;
-	boost::asio::ip::tcp::socket    m_socket;
-	boost::asio::streambuf          m_request;
-	boost::asio::streambuf          m_response;
+	boost::asio::deadline_timer     m_timer;
+
+	Options m_options;
+
+	// Number of retries of a read that receive no data.
+	//
+	size_t m_retries;
+
+	// Pool of connections, all requests are driven by m_ioservice.
+	//
+	std::vector<Connection *> m_connections;
 
 	std::string m_server;
 	std::string m_path;
 
+	// Resolved endpoints of the server, address families interleaved
+	// (IPv6 first), and the last one that was connected. Kept for
+	// the life of the device, reconnects don't resolve again.
+	//
+	std::vector<boost::asio::ip::tcp::endpoint> m_endpoints;
+	boost::asio::ip::tcp::endpoint m_lastEndpoint;
+
 	off_t  m_fileSize;
-        off_t  m_contentLength;
-        char  *m_data;
-        size_t m_size;
 
-	// If true, error has been detected.
+	// Number of requests queued on a connection, 1 if requests are
+	// not pipelined (also when server closes connections).
 	//
-	bool m_error;
+	size_t m_pipeline;
 
-	// If true, server supports only closed connection.
+	// Stride of the reads being fetched, requests are queued only if
+	// it is the same as the last one (0 otherwise), reads of another
+	// size would not use them.
 	//
-	bool m_closed;
+	off_t  m_stride;
+	off_t  m_lastStride;
+
+	// If false, the server ignores requests of several ranges.
+	//
+	bool m_multiRange;
+
+	// Streaming mode used if the server ignores ranges: the file is
+	// read by a request of the whole file on the first connection and
+	// m_streamOffset is offset of the next byte of its body. Stream
+	// is not open if it has been interrupted.
+	//
+	bool  m_stream;
+	bool  m_streamOpen;
+	off_t m_streamOffset;
+
+	// Bytes of the body that are not read yet (-1 if the body ends
+	// when connection is closed or by the last chunk).
+	//
+	off_t m_bodyLeft;
+
+	// Body is chunked, m_chunkLeft bytes of the current chunk are not
+	// read yet.
+	//
+	bool  m_chunked;
+	off_t m_chunkLeft;
+
+	// ETag or Last-Modified of the file.
+	//
+	std::string m_etag;
+	std::string m_lastModified;
+
+	// Beginning of the file received by open().
+	//
+	std::vector<char> m_head;
+
+	// Set by cancel() (possibly by another thread), taken by the read
+	// in progress. If m_aborted is true, requests of the last read
+	// have been aborted.
+	//
+	bool m_cancelled;
+	bool m_aborted;
 };
 
 #endif
-
@@ -0,0 +1,364 @@
+#include "DeviceMirrors.hpp"
+#include "DeviceHttp.hpp"
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <algorithm>
+
+extern bool g_DebugMode;
+
+/** Weight of a new sample in moving average of throughput.
+**/
+static const double Alpha = 0.25;
+
+DeviceMirrors::Shared::Shared() :
+	sampleLen(0),
+	lastLen(0),
+	repeats(0)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+DeviceMirrors::Shared::~Shared()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+DeviceMirrors::DeviceMirrors(const Options& options) :
+	m_options(options),
+	m_shared(new Shared()),
+	m_size(0)
+{
+}
+
+DeviceMirrors::~DeviceMirrors()
+{
+	for (size_t i = 0; i < m_devices.size(); i++)
+		delete m_devices[i];
+}
+
+bool DeviceMirrors::open(const char *name)
+{
+	/** Devices of mirrors read a single URL.
+	**/
+	Options options = m_options;
+	options.mirrors.clear();
+
+	std::vector<std::string> urls(1, name);
+	urls.insert(urls.end(), m_options.mirrors.begin(), m_options.mirrors.end());
+
+	std::vector<Mirror>& mirrors = m_shared->mirrors;
+	int error = ENOENT;
+	bool sized = false;
+	int ranged = -1;
+
+	for (size_t i = 0; i < urls.size(); i++)
+	{
+		Mirror m;
+		m.url = urls[i];
+		m.rate = 0;
+		m.samples = 0;
+		m.inFlight = 0;
+		m.failures = 0;
+		m.dropped = false;
+		mirrors.push_back(m);
+
+		Device *dev = new DeviceHttp(options);
+		m_devices.push_back(dev);
+
+		if (!dev->open(urls[i].c_str()))
+		{
+			error = errno;
+			delete dev;
+			m_devices[i] = NULL;
+			mirrors[i].dropped = true;
+			std::cerr << "Mirror " << urls[i] << " dropped (not available)" << std::endl;
+			continue;
+		}
+
+		/** All mirrors must have the same file, the first one
+		 *  available decides.
+		**/
+		if (!sized)
+		{
+			m_size = dev->size();
+			sized = true;
+		}
+		else if (dev->size() != m_size)
+		{
+			mirrors[i].dropped = true;
+			std::cerr << "Mirror " << urls[i] << " dropped (size " << dev->size() << " differs from " << m_size << ")" << std::endl;
+			continue;
+		}
+
+		if ((ranged == -1) && !dev->sequential())
+			ranged = i;
+	}
+
+	if (!sized)
+	{
+		errno = error;
+		return false;
+	}
+
+	/** Mirrors that ignore ranges can serve only sequential reads,
+	 *  they are used if there is no other mirror and only one of
+	 *  them then.
+	**/
+	bool stream = false;
+	for (size_t i = 0; i < mirrors.size(); i++)
+	{
+		if (mirrors[i].dropped || !m_devices[i]->sequential())
+			continue;
+
+		if ((ranged == -1) && !stream)
+		{
+			stream = true;
+			continue;
+		}
+
+		mirrors[i].dropped = true;
+		std::cerr << "Mirror " << urls[i] << " dropped (ranges not supported)" << std::endl;
+	}
+
+	return true;
+}
+
+ssize_t DeviceMirrors::pread(char *buf, size_t len, off_t offset)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	return preadv(&iov, 1, offset);
+}
+
+ssize_t DeviceMirrors::preadv(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	/** Failed read is tried on other mirrors.
+	**/
+	std::vector<bool> tried(m_devices.size(), false);
+	int error = ENOENT;
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	while (true)
+	{
+		int mirror = choose(tried);
+		if (mirror == -1)
+		{
+			errno = error;
+			return -1;
+		}
+		tried[mirror] = true;
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		ssize_t r = m_devices[mirror]->preadv(iov, iovcnt, offset);
+		error = errno;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		finish(mirror, len, r, error, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+		if (r != -1)
+			return r;
+
+		/** Cancelled read is not tried again.
+		**/
+		if (error == ECANCELED)
+		{
+			errno = error;
+			return -1;
+		}
+
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", mirror " << mirror << " failed: " << error << std::endl;
+	}
+}
+
+off_t DeviceMirrors::size()
+{
+	return m_size;
+}
+
+void DeviceMirrors::cancel()
+{
+	for (size_t i = 0; i < m_devices.size(); i++)
+	{
+		if (m_devices[i] != NULL)
+			m_devices[i]->cancel();
+	}
+}
+
+bool DeviceMirrors::sequential() const
+{
+	/** A mirror that ignores ranges is used only alone.
+	**/
+	for (size_t i = 0; i < m_devices.size(); i++)
+	{
+		if ((m_devices[i] != NULL) && !m_shared->mirrors[i].dropped)
+			return m_devices[i]->sequential();
+	}
+	return false;
+}
+
+std::string DeviceMirrors::version()
+{
+	/** Mirrors may identify the same content differently, version
+	 *  of the first mirror in use is used.
+	**/
+	for (size_t i = 0; i < m_devices.size(); i++)
+	{
+		if ((m_devices[i] != NULL) && !m_shared->mirrors[i].dropped)
+			return m_shared->mirrors[i].url + " " + m_devices[i]->version();
+	}
+	return std::string();
+}
+
+Device *DeviceMirrors::clone() const
+{
+	DeviceMirrors *dev = new DeviceMirrors(m_options);
+
+	dev->m_shared = m_shared;
+	dev->m_size = m_size;
+
+	for (size_t i = 0; i < m_devices.size(); i++)
+		dev->m_devices.push_back((m_devices[i] != NULL) ? m_devices[i]->clone() : NULL);
+
+	return dev;
+}
+
+int DeviceMirrors::choose(const std::vector<bool>& tried)
+{
+	pthread_mutex_lock(&m_shared->mutex);
+
+	std::vector<Mirror>& mirrors = m_shared->mirrors;
+
+	/** Mirrors not measured yet are expected to be as fast as the
+	 *  fastest one, so that they get reads.
+	**/
+	double best = 0;
+	for (size_t i = 0; i < mirrors.size(); i++)
+	{
+		if (!mirrors[i].dropped)
+			best = std::max(best, mirrors[i].rate);
+	}
+	if (best == 0)
+		best = 1;
+
+	/** Take mirror that finishes the read first if its throughput
+	 *  is shared by reads in flight.
+	**/
+	int mirror = -1;
+	double score = 0;
+	for (size_t i = 0; i < mirrors.size(); i++)
+	{
+		if (mirrors[i].dropped || (m_devices[i] == NULL) || tried[i])
+			continue;
+
+		double rate = (mirrors[i].rate > 0) ? mirrors[i].rate : best;
+		double s = rate / (mirrors[i].inFlight + 1);
+		if ((mirror == -1) || (s > score))
+		{
+			mirror = i;
+			score = s;
+		}
+	}
+
+	if (mirror != -1)
+		mirrors[mirror].inFlight++;
+
+	pthread_mutex_unlock(&m_shared->mutex);
+
+	return mirror;
+}
+
+void DeviceMirrors::finish(int mirror, size_t len, ssize_t r, int error, double seconds)
+{
+	pthread_mutex_lock(&m_shared->mutex);
+
+	Shared& s = *m_shared;
+	Mirror& m = s.mirrors[mirror];
+	m.inFlight--;
+
+	/** Latency dominates small reads (of data the reader waits for,
+	 *  at end of file), mirrors are compared only by reads of the
+	 *  size that repeats, the adapted read size. Rates measured by
+	 *  reads of another size are replaced.
+	**/
+	if (len == s.lastLen)
+		s.repeats++;
+	else
+	{
+		s.lastLen = len;
+		s.repeats = 1;
+	}
+	if ((s.repeats >= SizeRepeats) && (len != s.sampleLen))
+	{
+		s.sampleLen = len;
+		for (size_t i = 0; i < s.mirrors.size(); i++)
+			s.mirrors[i].samples = 0;
+	}
+
+	if ((r == -1) && (error == ECANCELED))
+	{
+		/** Cancelled read tells nothing about the mirror.
+		**/
+	}
+	else if (r == -1)
+	{
+		if (++m.failures >= MaxFailures)
+			drop(mirror, "failing");
+	}
+	else
+	{
+		m.failures = 0;
+
+		if ((r > 0) && (static_cast<size_t>(r) == len) && (len == s.sampleLen) && (seconds > 0))
+		{
+			double rate = r / seconds;
+			m.rate = (m.samples == 0) ? rate : m.rate + Alpha * (rate - m.rate);
+			m.samples++;
+		}
+
+		double best = 0;
+		for (size_t i = 0; i < s.mirrors.size(); i++)
+		{
+			if (!s.mirrors[i].dropped && (s.mirrors[i].samples > 0))
+				best = std::max(best, s.mirrors[i].rate);
+		}
+
+		if ((m.samples >= MinSamples) && (m.rate * SlowFactor < best))
+			drop(mirror, "slow");
+	}
+
+	pthread_mutex_unlock(&m_shared->mutex);
+}
+
+void DeviceMirrors::drop(int mirror, const char *reason)
+{
+	std::vector<Mirror>& mirrors = m_shared->mirrors;
+
+	if (mirrors[mirror].dropped)
+		return;
+
+	size_t active = 0;
+	for (size_t i = 0; i < mirrors.size(); i++)
+	{
+		if (!mirrors[i].dropped)
+			active++;
+	}
+
+	/** The last mirror is kept, its failures are reported to reader.
+	**/
+	if (active <= 1)
+		return;
+
+	mirrors[mirror].dropped = true;
+
+	std::cerr << "Mirror " << mirrors[mirror].url << " dropped (" << reason << ")" << std::endl;
+}
@@ -0,0 +1,122 @@
+#ifndef DEVICEMIRRORS_HPP
+#define DEVICEMIRRORS_HPP
+
+#include "Device.hpp"
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <boost/shared_ptr.hpp>
+
+/** Device reading the same file from several HTTP mirrors. Each read
+ *  goes to one mirror, reads in flight (of copies made by clone())
+ *  are spread over mirrors by their measured throughput. Mirrors that
+ *  fail repeatedly or are much slower than the best one are dropped.
+**/
+class DeviceMirrors : public Device
+{
+public:
+	/** Constructor.
+	 *  @param options settings, mirrors are URLs of the file besides
+	 *  the one given to open()
+	**/
+	DeviceMirrors(const Options& options);
+	~DeviceMirrors();
+
+	bool open(const char *name);
+	ssize_t pread(char *buf, size_t len, off_t offset);
+	ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset);
+	off_t size();
+	void cancel();
+	using Device::cancel;
+	std::string version();
+	bool sequential() const;
+	Device *clone() const;
+
+private:
+	/** State of a mirror shared by all copies of the device.
+	**/
+	struct Mirror
+	{
+		std::string url;
+
+		/** Throughput in bytes per second, 0 if not measured yet.
+		**/
+		double      rate;
+
+		/** Number of samples of rate measured by reads of the
+		 *  current sample size.
+		**/
+		size_t      samples;
+		size_t      inFlight;
+
+		/** Number of failed reads in a row.
+		**/
+		size_t      failures;
+
+		bool        dropped;
+	};
+
+	struct Shared
+	{
+		Shared();
+		~Shared();
+
+		std::vector<Mirror> mirrors;
+
+		/** Size of reads that measure throughput (0 if not known
+		 *  yet), size of the last read and number of reads of that
+		 *  size in a row.
+		**/
+		size_t              sampleLen;
+		size_t              lastLen;
+		size_t              repeats;
+
+		pthread_mutex_t     mutex;
+	};
+
+	/** Choose mirror for the next read and account it in flight.
+	 *  @param tried mirrors the read failed on already
+	 *  @return index of mirror or -1 if there is none left
+	**/
+	int choose(const std::vector<bool>& tried);
+
+	/** Account finished read.
+	 *  @param mirror index returned by choose()
+	 *  @param len requested size of the read
+	 *  @param r result of the read
+	 *  @param error errno of a failed read
+	 *  @param seconds duration of the read
+	**/
+	void finish(int mirror, size_t len, ssize_t r, int error, double seconds);
+
+	/** Drop mirror unless it is the last one. Mutex must be locked.
+	**/
+	void drop(int mirror, const char *reason);
+
+	/** Number of failed reads in a row that drop a mirror.
+	**/
+	static const size_t MaxFailures = 3;
+
+	/** Mirror is dropped if it is this many times slower than the
+	 *  fastest one, after MinSamples reads.
+	**/
+	static const size_t SlowFactor = 8;
+	static const size_t MinSamples = 8;
+
+	/** Number of reads of the same size in a row that make it the
+	 *  sample size.
+	**/
+	static const size_t SizeRepeats = 4;
+
+	Options m_options;
+
+	boost::shared_ptr<Shared> m_shared;
+
+	/** Device for each mirror, NULL if dropped.
+	**/
+	std::vector<Device *> m_devices;
+
+	off_t m_size;
+};
+
+#endif
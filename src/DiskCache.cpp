@@ -0,0 +1,171 @@
+#include "DiskCache.hpp"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <boost/functional/hash.hpp>
+
+extern bool g_DebugMode;
+
+DiskCache::DiskCache(const std::string& path) :
+	m_path(path),
+	m_usable(false),
+	m_fd(-1),
+	m_mapFd(-1),
+	m_dirty(0),
+	m_flushed(time(NULL)),
+	m_lastChunk(0)
+{
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+DiskCache::~DiskCache()
+{
+	if (m_usable)
+		writeMap();
+	if (m_fd != -1)
+		::close(m_fd);
+	if (m_mapFd != -1)
+		::close(m_mapFd);
+
+	pthread_mutex_destroy(&m_mutex);
+}
+
+bool DiskCache::open(const char *name, off_t size, const std::string& version)
+{
+	std::ostringstream header;
+	header << "preloadfs cache 1\n" << name << "\n" << size << "\n" << version << "\n";
+
+	pthread_mutex_lock(&m_mutex);
+
+	/** Cache is only an optimization, continue without it
+	 *  if it can't be used.
+	**/
+	if (m_header.empty())
+	{
+		m_header = header.str();
+		m_usable = openFiles(name, size);
+
+		if (!m_usable && g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", cache not used: " << strerror(errno) << std::endl;
+	}
+
+	bool r = m_usable && (m_header == header.str());
+
+	pthread_mutex_unlock(&m_mutex);
+
+	return r;
+}
+
+bool DiskCache::openFiles(const char *name, off_t size)
+{
+	std::ostringstream base;
+	base << m_path << "/preloadfs-" << std::hex << boost::hash<std::string>()(name);
+
+	m_mapFd = ::open((base.str() + ".map").c_str(), O_RDWR | O_CREAT, 0600);
+	if (m_mapFd == -1)
+		return false;
+
+	/** Other instance may use the same cache.
+	**/
+	if (::flock(m_mapFd, LOCK_EX | LOCK_NB) == -1)
+		return false;
+
+	m_fd = ::open((base.str() + ".data").c_str(), O_RDWR | O_CREAT, 0600);
+	if (m_fd == -1)
+		return false;
+
+	std::string expected = m_header;
+	expected.resize(HeaderSize, '\0');
+
+	m_map.assign((size / ChunkSize + 1 + 7) / 8, 0);
+	m_lastChunk = (size > 0) ? (size - 1) / ChunkSize : 0;
+
+	std::vector<char> stored(HeaderSize);
+	if ((::pread(m_mapFd, &stored[0], HeaderSize, 0) == static_cast<ssize_t>(HeaderSize)) &&
+	    (memcmp(&stored[0], expected.data(), HeaderSize) == 0) &&
+	    (::pread(m_mapFd, &m_map[0], m_map.size(), HeaderSize) == static_cast<ssize_t>(m_map.size())))
+	{
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", reusing " << base.str() << std::endl;
+		return true;
+	}
+
+	/** Cache is missing or stale, start with an empty one.
+	**/
+	std::fill(m_map.begin(), m_map.end(), 0);
+
+	if ((::ftruncate(m_fd, 0) == -1) ||
+	    (::ftruncate(m_fd, size) == -1) ||
+	    (::ftruncate(m_mapFd, 0) == -1) ||
+	    (::pwrite(m_mapFd, expected.data(), HeaderSize, 0) != static_cast<ssize_t>(HeaderSize)) ||
+	    (::pwrite(m_mapFd, &m_map[0], m_map.size(), HeaderSize) != static_cast<ssize_t>(m_map.size())))
+		return false;
+
+	return true;
+}
+
+bool DiskCache::present(off_t chunk)
+{
+	pthread_mutex_lock(&m_mutex);
+	bool r = m_map[chunk / 8] & (1 << (chunk % 8));
+	pthread_mutex_unlock(&m_mutex);
+
+	return r;
+}
+
+bool DiskCache::store(const char *buf, size_t len, off_t offset)
+{
+	if (::pwrite(m_fd, buf, len, offset) != static_cast<ssize_t>(len))
+		return false;
+
+	off_t first = offset / ChunkSize;
+	off_t last = (offset + len - 1) / ChunkSize;
+
+	pthread_mutex_lock(&m_mutex);
+
+	for (off_t chunk = first; chunk <= last; chunk++)
+		m_map[chunk / 8] |= 1 << (chunk % 8);
+
+	/** Flush often enough to lose little on a crash, and once the
+	 *  end of the file is fetched (small files never reach
+	 *  FlushChunks).
+	**/
+	m_dirty += last - first + 1;
+	if ((m_dirty >= FlushChunks) || (last >= m_lastChunk) || (time(NULL) - m_flushed >= FlushSeconds))
+		writeMap();
+
+	pthread_mutex_unlock(&m_mutex);
+
+	return true;
+}
+
+void DiskCache::flush()
+{
+	pthread_mutex_lock(&m_mutex);
+	if (m_usable)
+		writeMap();
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void DiskCache::writeMap()
+{
+	m_flushed = time(NULL);
+
+	if (m_dirty == 0)
+		return;
+
+	/** Bitmap must never claim data that did not reach the disk.
+	**/
+	if (::fdatasync(m_fd) == 0)
+	{
+		::pwrite(m_mapFd, &m_map[0], m_map.size(), HeaderSize);
+		m_dirty = 0;
+	}
+}
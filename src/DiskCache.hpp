@@ -0,0 +1,115 @@
+#ifndef DISKCACHE_HPP
+#define DISKCACHE_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+/** Persistent cache of a file. Data are kept in a sparse file in the
+ *  temporary path together with a bitmap of present chunks, both
+ *  survive remounts. Cache is keyed by name of the file, its size and
+ *  version (ETag); stale cache is discarded.
+ *
+ *  Cache is shared by all devices reading the file (see DeviceCached),
+ *  it is thread-safe.
+**/
+class DiskCache
+{
+public:
+	/** Constructor.
+	 *  @param path directory of cache files
+	**/
+	DiskCache(const std::string& path);
+	~DiskCache();
+
+	/** Open cache files and load bitmap. May be called repeatedly,
+	 *  cache is opened only once.
+	 *  @return false if cache can't be used for the file
+	**/
+	bool open(const char *name, off_t size, const std::string& version);
+
+	/** Return true if chunk is present in the cache file.
+	**/
+	bool present(off_t chunk);
+
+	/** Store data fetched from device to the cache file and mark
+	 *  chunks they cover as present. Data must start at a chunk
+	 *  boundary and cover whole chunks (except the last one of
+	 *  the file).
+	 *  @return false on error (errno is set)
+	**/
+	bool store(const char *buf, size_t len, off_t offset);
+
+	/** Write bitmap of stored chunks to the map file, cache file
+	 *  data first. Called when reading is idle and at unmount,
+	 *  store() flushes by itself only from time to time.
+	**/
+	void flush();
+
+	/** Return file descriptor of the cache file.
+	**/
+	int fd() const { return m_fd; }
+
+	/** Size of a chunk tracked by the bitmap.
+	**/
+	static const size_t ChunkSize = 64 * 1024;
+
+private:
+	bool openFiles(const char *name, off_t size);
+
+	/** flush() with m_mutex locked.
+	**/
+	void writeMap();
+
+	/** Size of the map file header, bitmap follows it.
+	**/
+	static const size_t HeaderSize = 4096;
+
+	/** Number of fetched chunks before bitmap is flushed.
+	**/
+	static const size_t FlushChunks = 64;
+
+	/** Number of seconds before bitmap of fetched chunks is
+	 *  flushed anyway.
+	**/
+	static const time_t FlushSeconds = 5;
+
+	std::string m_path;
+
+	/** Header of the map file identifying the cached file, empty
+	 *  until open() is called.
+	**/
+	std::string m_header;
+
+	/** True if cache files are opened.
+	**/
+	bool        m_usable;
+
+	/** Cache file (sparse copy of the device).
+	**/
+	int         m_fd;
+
+	/** Map file (header and bitmap of present chunks).
+	**/
+	int         m_mapFd;
+
+	std::vector<unsigned char> m_map;
+
+	/** Chunks fetched since the last flush().
+	**/
+	size_t      m_dirty;
+
+	/** Time of the last flush().
+	**/
+	time_t      m_flushed;
+
+	/** Last chunk of the file, bitmap is flushed when it is stored.
+	**/
+	off_t       m_lastChunk;
+
+	pthread_mutex_t m_mutex;
+};
+
+#endif
@@ -5,7 +5,7 @@
 #include <vector>
 #include <iostream>
 
-FBuffer::FBuffer(const std::string& tmpPath, int bufferSize) :
+FBuffer::FBuffer(const std::string& tmpPath, size_t bufferSize) :
 	CBuffer(bufferSize)
 {
 	std::string name = "/XXXXXX";
@@ -13,6 +13,7 @@ FBuffer::FBuffer(const std::string& tmpPath, int bufferSize) :
 
 	fullPath.assign(tmpPath.begin(), tmpPath.end());
 	fullPath.insert(fullPath.end(), name.begin(), name.end());
+	fullPath.push_back('\0');
 
 	m_fd = ::mkstemp(&fullPath[0]);
 	::unlink(&fullPath[0]);
@@ -23,12 +24,12 @@ FBuffer::~FBuffer()
 	close(m_fd);
 }
 
-int FBuffer::write(int pos, char *buf, int len)
+ssize_t FBuffer::write(size_t pos, char *buf, size_t len)
 {
 	return ::pwrite(m_fd, buf, len, pos);
 }
 
-int FBuffer::read(int pos, char *buf, int len)
+ssize_t FBuffer::read(size_t pos, char *buf, size_t len)
 {
 	return ::pread(m_fd, buf, len, pos);
 }
@@ -10,12 +10,14 @@
 class FBuffer : public CBuffer
 {
 public:
-	FBuffer(const std::string& tmpPath, int bufferSize);
+	FBuffer(const std::string& tmpPath, size_t bufferSize);
 	~FBuffer();
 
+	int fd() const { return m_fd; }
+
 private:
-	int read(int pos, char *buf, int len);
-	int write(int pos, char *buf, int len);
+	ssize_t read(size_t pos, char *buf, size_t len);
+	ssize_t write(size_t pos, char *buf, size_t len);
 
 	/** Back storage's file descriptor.
 	**/
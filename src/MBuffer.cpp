@@ -1,26 +1,160 @@
 #include "MBuffer.hpp"
+#include <sys/mman.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <new>
 
-MBuffer::MBuffer(const std::string&, int bufferSize) :
-	CBuffer(bufferSize)
+static size_t roundUp(size_t size, size_t align)
 {
-	m_buffer = new char[bufferSize];
+	return (size + align - 1) / align * align;
+}
+
+MBuffer::MBuffer(const std::string&, size_t bufferSize, Pages pages) :
+	CBuffer(roundUp(bufferSize, pageSize(pages))),
+	m_buffer(NULL),
+	m_fd(-1),
+	m_mirrored(false)
+{
+	if (pages == PagesHuge)
+	{
+		/** Try huge pages memory file first to keep the buffer
+		 *  available by file descriptor, then anonymous huge pages.
+		**/
+		m_fd = ::memfd_create("preloadfs", MFD_CLOEXEC | MFD_HUGETLB);
+		if (m_fd != -1)
+			map(0, pageSize(pages));
+		if (m_buffer == NULL)
+			map(MAP_HUGETLB, pageSize(pages));
+	}
+
+	if (m_buffer == NULL)
+	{
+		m_fd = ::memfd_create("preloadfs", MFD_CLOEXEC);
+		if (m_fd != -1)
+			map(0, pageSize(PagesNormal));
+
+		/** Memory file is not supported, fall back to
+		 *  plain memory.
+		**/
+		if ((m_buffer == NULL) && !map(0, pageSize(PagesNormal)))
+			throw std::bad_alloc();
+
+		/** Transparent huge pages are only a hint, ignore errors.
+		**/
+		if (pages == PagesTransparent)
+			::madvise(m_buffer, m_mirrored ? 2 * size() : size(), MADV_HUGEPAGE);
+	}
 }
 
 MBuffer::~MBuffer()
 {
-	delete m_buffer;
+	::munmap(m_buffer, m_mirrored ? 2 * size() : size());
+	if (m_fd != -1)
+		::close(m_fd);
 }
 
-int MBuffer::write(int pos, char *buf, int len)
+bool MBuffer::map(int flags, size_t align)
+{
+	void *p = MAP_FAILED;
+
+	if (m_fd != -1)
+	{
+		if (::ftruncate(m_fd, size()) == 0)
+		{
+			if (mapMirrored(align))
+				return true;
+
+			p = ::mmap(NULL, size(), PROT_READ | PROT_WRITE, MAP_SHARED | flags, m_fd, 0);
+		}
+
+		if (p == MAP_FAILED)
+		{
+			::close(m_fd);
+			m_fd = -1;
+			return false;
+		}
+	}
+	else
+	{
+		p = ::mmap(NULL, size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+		if (p == MAP_FAILED)
+			return false;
+	}
+
+	m_buffer = static_cast<char *>(p);
+	return true;
+}
+
+bool MBuffer::mapMirrored(size_t align)
+{
+	size_t len = 2 * size() + align;
+
+	/** Reserve address space for both mappings first.
+	**/
+	void *p = ::mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+
+	char *reserved = static_cast<char *>(p);
+	char *base = reinterpret_cast<char *>(roundUp(reinterpret_cast<uintptr_t>(reserved), align));
+
+	if ((::mmap(base, size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_fd, 0) == MAP_FAILED) ||
+	    (::mmap(base + size(), size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_fd, 0) == MAP_FAILED))
+	{
+		::munmap(reserved, len);
+		return false;
+	}
+
+	/** Return unused parts of the reservation.
+	**/
+	if (base > reserved)
+		::munmap(reserved, base - reserved);
+	if (reserved + len > base + 2 * size())
+		::munmap(base + 2 * size(), reserved + len - (base + 2 * size()));
+
+	m_buffer = base;
+	m_mirrored = true;
+	return true;
+}
+
+size_t MBuffer::pageSize(Pages pages)
+{
+	size_t size = ::sysconf(_SC_PAGESIZE);
+
+	if (pages != PagesHuge)
+		return size;
+
+	size = 2 * 1024 * 1024;
+
+	FILE *f = ::fopen("/proc/meminfo", "r");
+	if (f != NULL)
+	{
+		char line[128];
+		unsigned long kb;
+
+		while (::fgets(line, sizeof(line), f) != NULL)
+		{
+			if (::sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+			{
+				size = kb * 1024;
+				break;
+			}
+		}
+		::fclose(f);
+	}
+	return size;
+}
+
+ssize_t MBuffer::write(size_t pos, char *buf, size_t len)
 {
 	memcpy(m_buffer + pos, buf, len);
 	return len;
 }
 
-int MBuffer::read(int pos, char *buf, int len)
+ssize_t MBuffer::read(size_t pos, char *buf, size_t len)
 {
 	memcpy(buf, m_buffer + pos, len);
 	return len;
 }
-
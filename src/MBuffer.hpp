@@ -1,26 +1,78 @@
-#ifndef FBUFFER_HPP
-#define FBUFFER_HPP
+#ifndef MBUFFER_HPP
+#define MBUFFER_HPP
 
 #include "CBuffer.hpp"
 #include <string>
 
 /** Implements CBuffer's read/write methods. Uses memory buffer as
- *  a back storage for circular buffer.
+ *  a back storage for circular buffer. Memory is backed by an anonymous
+ *  memory file when possible so the buffer's content can be handed over
+ *  to FUSE by file descriptor (splice) instead of being copied. The file
+ *  is mapped twice back-to-back so data wrapping around the end of the
+ *  buffer are still contiguous in memory.
 **/
 class MBuffer : public CBuffer
 {
 public:
-	MBuffer(const std::string& tmpPath, int bufferSize);
+	/** How memory of the buffer is allocated.
+	**/
+	enum Pages
+	{
+		/** Regular pages.
+		**/
+		PagesNormal,
+
+		/** Ask kernel to back the buffer with transparent huge pages.
+		**/
+		PagesTransparent,
+
+		/** Allocate the buffer from the huge pages pool (hugetlbfs).
+		**/
+		PagesHuge
+	};
+
+	/** Constructor. Size of the buffer is rounded up to the page
+	 *  size (huge page size for PagesHuge).
+	**/
+	MBuffer(const std::string& tmpPath, size_t bufferSize, Pages pages = PagesNormal);
 	~MBuffer();
 
+	int fd() const { return m_fd; }
+	char *address(size_t pos) const { return m_buffer + pos; }
+	bool isMirrored() const { return m_mirrored; }
+
 private:
-	int read(int pos, char *buf, int len);
-	int write(int pos, char *buf, int len);
+	ssize_t read(size_t pos, char *buf, size_t len);
+	ssize_t write(size_t pos, char *buf, size_t len);
+
+	/** Map m_fd (or anonymous memory if m_fd is -1) to m_buffer.
+	 *  @param flags additional mmap flags
+	 *  @param align alignment of the mapping
+	 *  @return true on success
+	**/
+	bool map(int flags, size_t align);
+
+	/** Map m_fd twice back-to-back to m_buffer.
+	 *  @return true on success
+	**/
+	bool mapMirrored(size_t align);
+
+	/** Return size of a page in bytes.
+	**/
+	static size_t pageSize(Pages pages);
 
 	/** Pointer to memory buffer.
 	**/
 	char *m_buffer;
+
+	/** Anonymous memory file the m_buffer is mapped from,
+	 *  -1 if m_buffer is anonymous memory.
+	**/
+	int m_fd;
+
+	/** True if m_fd is mapped twice.
+	**/
+	bool m_mirrored;
 };
 
 #endif
-
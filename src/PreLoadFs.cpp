@@ -1,29 +1,103 @@
 #include "PreLoadFs.hpp"
 #include "Device.hpp"
+#include "DeviceCached.hpp"
+#include "DiskCache.hpp"
+#include "FBuffer.hpp"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
 #include <dirent.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <iostream>
+#include <sstream>
+#include <deque>
+#include <vector>
 
 extern bool g_DebugMode;
 
-PreLoadFs::PreLoadFs(const std::string& tmpPath, size_t tmpSize, const std::string& fileToMount) :
+PreLoadFs::Options::Options() :
+	tmpPath("/tmp"),
+	bufferSize(128 * 1024),
+	pages(MBuffer::PagesNormal),
+	lookBehind(0),
+	mode(ModeRing),
+	blockSize(256 * 1024),
+	persistent(false),
+	spillSize(0),
+	depth(1),
+	lowWatermark(0),
+	highWatermark(0)
+{
+}
+
+PreLoadFs::PreLoadFs(const Options& options, const std::string& fileToMount) :
 	m_name(fileToMount),
+	m_deviceOptions(options.device),
 	m_refs(0),
 	m_offset(0),
-	m_buffer(tmpPath, tmpSize),
+	m_buffer(NULL),
+	m_chunk(NULL),
+	m_queue(NULL),
+	m_spill(NULL),
+	m_cache(NULL),
 	m_exception(false),
-	m_seeked(false),
-	m_size(0)
+	m_seekRequest(0),
+	m_seekDone(0),
+	m_seekOffset(0),
+	m_seekMark(0),
+	m_seekPending(false),
+	m_size(0),
+	m_diskCache(NULL),
+	m_demand(0),
+	m_pinned(0),
+	m_highWatermark(0),
+	m_wakeups(0),
+	m_batches(0),
+	m_batchBytes(0)
 {
+	/** Local files are not worth copying to the temporary path.
+	**/
+	if (options.persistent && (strncasecmp(fileToMount.c_str(), "http://", 7) == 0))
+		m_diskCache = new DiskCache(options.tmpPath);
+
+	if (options.mode == ModeBlocks)
+		m_cache = new BlockCache(options.bufferSize, options.blockSize);
+	else
+	{
+		m_buffer = new MBuffer(options.tmpPath, options.bufferSize, options.pages);
+		m_buffer->setLookBehind(options.lookBehind);
+
+		m_highWatermark = m_buffer->size();
+		if (options.highWatermark > 0)
+			m_highWatermark = std::min(options.highWatermark, m_highWatermark);
+		m_buffer->setLowWatermark((options.lowWatermark > 0) ? std::min(options.lowWatermark, m_highWatermark) : m_highWatermark);
+
+		/** Reads from 64 KiB up to 8 MiB, but leave space in the
+		 *  buffer for a few of them.
+		**/
+		size_t minChunk = std::min<size_t>(64 * 1024, m_buffer->size());
+		m_chunk = new ChunkSize(minChunk, std::min<size_t>(8 * 1024 * 1024, m_buffer->size() / 4));
+
+		m_queue = new ReadQueue(std::max<size_t>(options.depth, 1));
+
+		if (options.spillSize > 0)
+			m_spill = new FBuffer(options.tmpPath, options.spillSize);
+	}
 }
 
 PreLoadFs::~PreLoadFs()
 {
+	delete m_cache;
+	delete m_chunk;
+	delete m_queue;
+	delete m_spill;
+	delete m_buffer;
+	delete m_diskCache;
 }
 
 void *PreLoadFs::init()
@@ -34,11 +108,7 @@ void *PreLoadFs::init()
 	if (r != 0)
 		exit(EXIT_FAILURE);
 
-	r = pthread_cond_init(&m_wakeupNewData, NULL);
-	if (r != 0)
-		exit(EXIT_FAILURE);
-
-	r = pthread_cond_init(&m_wakeupReadNewData, NULL);
+	r = pthread_mutex_init(&m_readMutex, NULL);
 	if (r != 0)
 		exit(EXIT_FAILURE);
 
@@ -56,9 +126,13 @@ void *PreLoadFs::init()
 void PreLoadFs::destroy(void *arg)
 {
 	/** Don't care about the thread, we are going to quit anyway.
+	 *  Destructor is never called, record fetched data now.
 	**/
 
 	assert(m_refs == 0);
+
+	if (m_diskCache != NULL)
+		m_diskCache->flush();
 }
 
 int PreLoadFs::getattr(const char *name, struct stat *st)
@@ -182,12 +256,22 @@ int PreLoadFs::release(const char *name, struct fuse_file_info * /*fi*/)
 	if (tmp.string().compare(&name[1]) == 0)
 	{
 		--m_refs;
+
+		pthread_mutex_lock(&m_readMutex);
+		unpin();
+		pthread_mutex_unlock(&m_readMutex);
 std::cout << "m_exception: " << m_exception << ", m_error: " << m_error << "\n";
 		/** Set flags to default state.
 		**/
+		pthread_mutex_lock(&m_mutex);
 		if ((m_exception == true) && (m_error == 0))
-			m_exception = false;
-		m_seeked = false;
+			__atomic_store_n(&m_exception, false, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&m_mutex);
+
+		/** Let know the thread that it can read new data.
+		**/
+		if (m_buffer != NULL)
+			m_buffer->wakeWriter();
 std::cout << "m_exception: " << m_exception << ", m_error: " << m_error << "\n";
 	}
 
@@ -195,7 +279,7 @@ std::cout << "m_exception: " << m_exception << ", m_error: " << m_error << "\n";
 }
 
 /**
- * m_mutex must be locked
+ * m_readMutex must be locked
 **/
 void PreLoadFs::seek(off_t offset)
 {
@@ -204,47 +288,211 @@ void PreLoadFs::seek(off_t offset)
 	if (g_DebugMode)
 		std::cout << __PRETTY_FUNCTION__ << std::hex << offset << std::dec << std::endl;
 
-	if ((m_offset < offset) && (m_offset + m_buffer.full() > offset))
+	if (!m_seekPending && (m_offset < offset) && (m_offset + static_cast<off_t>(m_buffer->full()) > offset))
 	{
 		/** There are data in the buffer covering required offset.
 		**/
 		assert(offset - m_offset > 0);
-		m_buffer.advance(offset - m_offset);
+		m_buffer->advance(offset - m_offset);
+	}
+	else if (!m_seekPending && (m_offset > offset) && (m_offset - static_cast<off_t>(m_buffer->behind()) <= offset))
+	{
+		/** Data for required offset are still in look-behind
+		 *  window.
+		**/
+		m_buffer->rewind(m_offset - offset);
 	}
 	else
 	{
-		/** Clear the circular buffer.
+		/** Let know the thread that we seeked to a new offset
+		 *  (It has to eventually discard data that has been read
+		 *  and not stored to circular buffer yet). Data already
+		 *  in the buffer are dropped in seekDone().
 		**/
-		m_buffer.clear();
+		pthread_mutex_lock(&m_mutex);
+		m_seekOffset = offset;
+		__atomic_store_n(&m_seekRequest, m_seekRequest + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&m_mutex);
 
-		/** Set flag to let know the thread that we seeked to
-		 *  a new offset (It has to eventually discard data
-		 *  that has been read and not stored to circular buffer
-		 *  yet.
-		**/
-		m_seeked = true;
+		m_seekPending = true;
 
-		/** Clear exception flag. It might be set when end of
-		 *  file detected, so seek should clear this exception.
+		/** Let know the thread that it shall read new data, reads
+		 *  in progress are not waited for.
 		**/
-		if ((m_exception == true) && (m_error == 0))
-			m_exception = false;
+		m_buffer->wakeWriter();
+		m_queue->abort();
 	}
 
 	/** Set offset to new value.
 	**/
 	m_offset = offset;
+}
+
+/**
+ * m_readMutex must be locked
+**/
+bool PreLoadFs::seekDone()
+{
+	if (m_seekPending && (__atomic_load_n(&m_seekDone, __ATOMIC_ACQUIRE) == m_seekRequest))
+	{
+		/** Drop data the thread stored for the old offset,
+		 *  including look-behind window.
+		**/
+		m_buffer->drop(m_seekMark - m_buffer->readPosition());
+		m_seekPending = false;
+	}
+	return !m_seekPending;
+}
+
+/**
+ * m_readMutex must be locked
+**/
+void PreLoadFs::waitData(size_t len)
+{
+	while (true)
+	{
+		/** Take the event first to not miss a wake-up.
+		**/
+		int event = m_buffer->dataEvent();
+
+		if (seekDone() && ((m_buffer->full() >= len) || exception()))
+			break;
+
+		/** Error detected while waiting for the thread
+		 *  to accept a seek.
+		**/
+		if (exception() && (m_error != 0))
+			break;
+
+		/** Let know the thread that it can read new data.
+		**/
+		m_buffer->wakeWriter();
+
+		/** Wait for a new data if buffer is empty or exception
+		 *  is detected (when exception is detected there will be no more
+		 *  data so we have to read what's available because there will
+		 *  not be any new data.
+		**/
+		m_buffer->waitData(event);
+	}
+
+	__atomic_store_n(&m_demand, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * m_readMutex must be locked
+**/
+void PreLoadFs::demand(size_t len)
+{
+	__atomic_store_n(&m_demand, len, __ATOMIC_RELAXED);
+}
+
+size_t PreLoadFs::missingDemand(size_t assigned) const
+{
+	size_t demand = __atomic_load_n(&m_demand, __ATOMIC_RELAXED);
+	if (demand == 0)
+		return 0;
+
+	/** Data stored before the last accepted seek are not for the
+	 *  reader, it drops them.
+	**/
+	uint64_t start = std::max(m_buffer->readPosition(), m_seekMark);
+	uint64_t covered = m_buffer->writePosition() + assigned - start;
+
+	return (covered < demand) ? demand - covered : 0;
+}
+
+/**
+ * m_readMutex must be locked
+**/
+void PreLoadFs::unpin()
+{
+	if (m_pinned == 0)
+		return;
+
+	/** FUSE replies are written synchronously after readBuf()
+	 *  returns. readBuf() is used only by single-threaded FUSE
+	 *  (see main.cpp), so when the next request arrives the
+	 *  kernel has consumed the data already.
+	**/
+	m_buffer->advance(m_pinned);
+	m_offset += m_pinned;
+	m_pinned = 0;
+}
+
+bool PreLoadFs::exception() const
+{
+	return __atomic_load_n(&m_exception, __ATOMIC_ACQUIRE);
+}
+
+void PreLoadFs::setException(int error)
+{
+	pthread_mutex_lock(&m_mutex);
+	m_error = error;
+	__atomic_store_n(&m_exception, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m_mutex);
+
+	/** Signal that there is an error (or end of file).
+	**/
+	if (m_buffer != NULL)
+		m_buffer->wakeReader();
+	else
+		m_cache->interrupt(error);
+}
+
+bool PreLoadFs::seekRequested() const
+{
+	return __atomic_load_n(&m_seekRequest, __ATOMIC_ACQUIRE) != m_seekDone;
+}
+
+off_t PreLoadFs::acceptSeek()
+{
+	pthread_mutex_lock(&m_mutex);
+
+	int request = m_seekRequest;
+	off_t offset = m_seekOffset;
 
-	/** Let know the thread that it shall read new data.
+	/** Clear exception flag. It might be set when end of
+	 *  file detected, so seek should clear this exception.
 	**/
-	pthread_cond_signal(&m_wakeupReadNewData);
+	if ((m_exception == true) && (m_error == 0))
+		__atomic_store_n(&m_exception, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&m_mutex);
+
+	/** Everything appended so far belongs to the old offset.
+	**/
+	m_seekMark = m_buffer->writePosition();
+	__atomic_store_n(&m_seekDone, request, __ATOMIC_RELEASE);
+
+	m_buffer->wakeReader();
+
+	return offset;
 }
 
 int PreLoadFs::stat(char *buf, size_t len)
 {
+	if (m_cache != NULL)
+		return m_cache->stat(buf, len);
+
 	/** Ignore locking, this is only for statistical purpose.
 	**/
-	return snprintf(buf, len, "FREE: %d, FULL: %d\n", m_buffer.free(), m_buffer.full());
+	std::ostringstream s;
+	s << "FREE: " << m_buffer->free() << ", FULL: " << m_buffer->full() <<
+	     ", BEHIND: " << m_buffer->behind() << ", CHUNK: " << m_chunk->size() <<
+	     ", QUEUE: " << m_queue->inFlight() << "/" << m_queue->depth();
+	if (m_spill != NULL)
+		s << ", SPILL: " << m_spill->full() << "/" << m_spill->size();
+	s << ", LOW: " << m_buffer->lowWatermark() << ", HIGH: " << m_highWatermark <<
+	     ", WAKEUPS: " << m_wakeups << ", BATCHES: " << m_batches <<
+	     ", BATCH: " << ((m_batches > 0) ? m_batchBytes / m_batches : 0) << "\n";
+
+	/** Reader may ask for less.
+	**/
+	std::string str = s.str();
+	size_t r = std::min(len, str.size());
+	memcpy(buf, str.data(), r);
+	return r;
 }
 
 int PreLoadFs::write(const char *name, const char *buf, size_t len, off_t offset, struct fuse_file_info * /*fi*/)
@@ -252,9 +500,7 @@ int PreLoadFs::write(const char *name, const char *buf, size_t len, off_t offset
 	if (strcmp(&name[1], ".stat") == 0)
 	{
 		// This unblock conditional loop in read()...
-		m_exception = true;
-		m_error = EINTR;
-		pthread_cond_signal(&m_wakeupReadNewData);
+		setException(EINTR);
 
 		return len;
 	}
@@ -276,7 +522,19 @@ int PreLoadFs::read(const char *name, char *buf, size_t len, off_t offset, struc
 	**/
 	assert(tmp.string().compare(&name[1]) == 0);
 
-	pthread_mutex_lock(&m_mutex);
+	/** Cache serves any offset by itself.
+	**/
+	if (m_cache != NULL)
+		return m_cache->read(buf, len, offset);
+
+	pthread_mutex_lock(&m_readMutex);
+
+	unpin();
+
+	/** Let the thread know what we wait for before it possibly
+	 *  starts reading from the new offset.
+	**/
+	demand(len);
 
 	/** Seek if user wants to read from offset different than we currently have.
 	**/
@@ -285,23 +543,14 @@ int PreLoadFs::read(const char *name, char *buf, size_t len, off_t offset, struc
 
 	while (len > 0)
 	{
-		while (m_buffer.isFree() && (m_exception == false))
-		{
-			/** Let know the thread that it can read new data.
-			**/
-			pthread_cond_signal(&m_wakeupReadNewData);
-
-			/** Wait for a new data if buffer is empty or exception
-			 *  is detected (when exception is detected there will be no more
-			 *  data so we have to read what's available because there will
-			 *  not be any new data.
-			**/
-			pthread_cond_wait(&m_wakeupNewData, &m_mutex);
-		}
+		demand(len);
+		waitData(1);
 
 		/** Read data from buffer.
 		**/
-		int r = m_buffer.get(buf, len);
+		ssize_t r = 0;
+		if (seekDone())
+			r = m_buffer->get(buf, len);
 
 		if (g_DebugMode)
 			std::cout << __PRETTY_FUNCTION__ << ", get returned: " << r << " (" << strerror(errno) << ")" << std::endl;
@@ -320,28 +569,24 @@ int PreLoadFs::read(const char *name, char *buf, size_t len, off_t offset, struc
 		**/
 		if (r == 0)
 		{
-			if (m_exception == true)
-			{
-				if (m_error != 0)
-				{
-					/** Error detected when read...
-					**/
-					pthread_mutex_unlock(&m_mutex);
+			assert(exception());
 
-					assert(m_error > 0);
-					return -m_error;
-				}
-
-				/** Just end of the file...
+			if (m_error != 0)
+			{
+				/** Error detected when read...
 				**/
-				break;
+				pthread_mutex_unlock(&m_readMutex);
+
+				assert(m_error > 0);
+				return -m_error;
 			}
+
+			/** Just end of the file...
+			**/
+			break;
 		}
-		/** Let know the thread that it can read new data.
-		**/
-		pthread_cond_signal(&m_wakeupReadNewData);
 	}
-	pthread_mutex_unlock(&m_mutex);
+	pthread_mutex_unlock(&m_readMutex);
 
 	/** Compute total bytes read.
 	**/
@@ -355,6 +600,109 @@ int PreLoadFs::read(const char *name, char *buf, size_t len, off_t offset, struc
 	return t;
 }
 
+#if FUSE_USE_VERSION >= 29
+int PreLoadFs::readBuf(const char *name, struct fuse_bufvec **bufp, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *bv;
+
+	/** Copy data if the buffer has no file descriptor to hand over
+	 *  or if the request can never fit into the buffer (next to
+	 *  look-behind window).
+	**/
+	if ((strcmp(&name[1], ".stat") == 0) ||
+	    (m_cache != NULL) ||
+	    (m_buffer->fd() == -1) ||
+	    (len + m_buffer->lookBehind() > m_buffer->size()))
+	{
+		char *mem = static_cast<char *>(malloc(len));
+		bv = static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+		if ((mem == NULL) || (bv == NULL))
+		{
+			free(mem);
+			free(bv);
+			return -ENOMEM;
+		}
+
+		int r = read(name, mem, len, offset, fi);
+		if (r < 0)
+		{
+			free(mem);
+			free(bv);
+			return r;
+		}
+
+		memset(bv, 0, sizeof(struct fuse_bufvec));
+		bv->count = 1;
+		bv->buf[0].size = r;
+		bv->buf[0].mem = mem;
+		bv->buf[0].fd = -1;
+
+		*bufp = bv;
+		return 0;
+	}
+
+	/** Space for two regions, one is already in struct fuse_bufvec.
+	**/
+	bv = static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf)));
+	if (bv == NULL)
+		return -ENOMEM;
+	memset(bv, 0, sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf));
+
+	pthread_mutex_lock(&m_readMutex);
+
+	unpin();
+
+	demand(len);
+
+	/** Seek if user wants to read from offset different than we currently have.
+	**/
+	if (m_offset != offset)
+		seek(offset);
+
+	/** Wait until whole request is buffered, short read would be
+	 *  understood as end of file.
+	**/
+	waitData(len);
+
+	if ((!seekDone() || m_buffer->isFree()) && exception() && (m_error != 0))
+	{
+		/** Error detected when read...
+		**/
+		pthread_mutex_unlock(&m_readMutex);
+		free(bv);
+
+		assert(m_error > 0);
+		return -m_error;
+	}
+
+	/** Hand over regions of the buffer to FUSE, they are
+	 *  released in the next request.
+	**/
+	CSpan span[2];
+	int n = m_buffer->readSpans(span, len);
+
+	bv->count = 1;
+	for (int i = 0; i < n; i++)
+	{
+		bv->buf[i].size = span[i].len;
+		bv->buf[i].flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+		bv->buf[i].fd = m_buffer->fd();
+		bv->buf[i].pos = span[i].pos;
+		m_pinned += span[i].len;
+	}
+	if (n > 0)
+		bv->count = n;
+
+	if (g_DebugMode)
+		std::cout << __PRETTY_FUNCTION__ << ", total ret: " << m_pinned << std::endl;
+
+	pthread_mutex_unlock(&m_readMutex);
+
+	*bufp = bv;
+	return 0;
+}
+#endif
+
 void *PreLoadFs::runT(void *arg)
 {
 	reinterpret_cast<PreLoadFs*>(arg)->run();
@@ -366,12 +714,9 @@ void *PreLoadFs::runT(void *arg)
 
 void PreLoadFs::run()
 {
-	off_t offset = 0;
 	off_t size = 0;
-	int   buf_size = std::min(64 * 1024, m_buffer.size());
-	char* buf = new char[buf_size];
 
-	Device *dev = Device::deviceFactory(m_name.string().c_str());
+	Device *dev = createDevice();
 
 	/** We are read only buffering 'filesystem'. So we open
 	 *  a file as read only. And we do not care about closing
@@ -390,12 +735,8 @@ void PreLoadFs::run()
 
 	if (false == b)
 	{
-		m_exception = true;
 		m_error = errno;
-
-		/** Signal that there is an error.
-		**/
-		pthread_cond_signal(&m_wakeupNewData);
+		__atomic_store_n(&m_exception, true, __ATOMIC_RELEASE);
 	}
 
 	m_size = size;
@@ -404,49 +745,392 @@ void PreLoadFs::run()
 	**/
 	pthread_cond_signal(&m_wakeupStatAvailable);
 
+	pthread_mutex_unlock(&m_mutex);
+
+	if (m_cache != NULL)
+	{
+		if (false == b)
+		{
+			/** Signal that there is an error.
+			**/
+			m_cache->interrupt(m_error);
+			return;
+		}
+
+		m_cache->setSize(size);
+		runCache(dev);
+	}
+	else
+	{
+		/** Signal that there is an error.
+		**/
+		if (false == b)
+			m_buffer->wakeReader();
+
+		runBuffer(dev, b);
+	}
+}
+
+Device *PreLoadFs::createDevice()
+{
+	Device *dev = Device::deviceFactory(m_name.string().c_str(), m_deviceOptions);
+	if (m_diskCache != NULL)
+		dev = new DeviceCached(dev, m_diskCache);
+	return dev;
+}
+
+void PreLoadFs::runCache(Device *dev)
+{
+	/** Maximal number of blocks fetched by one device read.
+	**/
+	const size_t maxBatch = 32;
+
+	std::vector<BlockCache::Block *> blocks;
+	std::vector<Device::Extent> extents;
+
 	while (true)
 	{
-		/** Wait until buffer is not full or exception is resolved.
+		/** Misses that wait together are fetched at once, network
+		 *  devices request them in one round trip.
 		**/
-		while (m_buffer.isFull() || (m_exception == true))
+		blocks.clear();
+		blocks.push_back(m_cache->next());
+		while (blocks.size() < maxBatch)
 		{
-			if (g_DebugMode)
-				std::cout << __PRETTY_FUNCTION__ << ", isFull: " << m_buffer.isFull() <<
-			                                            ", exception: " << m_exception << std::endl;
+			BlockCache::Block *block = m_cache->nextMiss();
+			if (block == NULL)
+				break;
+			blocks.push_back(block);
+		}
 
-			pthread_cond_wait(&m_wakeupReadNewData, &m_mutex);
+		extents.resize(blocks.size());
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			extents[i].offset = blocks[i]->index * m_cache->blockSize();
+			extents[i].buf = blocks[i]->data;
+			extents[i].len = m_cache->blockSize();
 		}
 
-		if (m_seeked == true)
+		dev->preadExtents(&extents[0], extents.size());
+
+		for (size_t i = 0; i < blocks.size(); i++)
 		{
-			m_seeked = false;
-			offset = m_offset;
+			/** Short block before end of file (device returned
+			 *  a part of the range) would be cached as valid.
+			**/
+			if ((extents[i].result != -1) &&
+			    (static_cast<size_t>(extents[i].result) < extents[i].len) &&
+			    (extents[i].offset + extents[i].result < m_size))
+			{
+				extents[i].result = -1;
+				extents[i].error = EIO;
+			}
+
+			if (extents[i].result == -1)
+				m_cache->filled(blocks[i], -1, extents[i].error);
+			else
+				m_cache->filled(blocks[i], extents[i].result, 0);
 		}
+	}
+}
 
-		int readBytes = std::min(buf_size, m_buffer.free());
+bool PreLoadFs::promote()
+{
+	while (!m_spill->isFree() && !m_buffer->isFull() && !seekRequested())
+	{
+		struct iovec iov[2];
+		int iovcnt = m_buffer->writeVector(iov, std::min<size_t>(m_spill->full(), 1024 * 1024));
+		size_t len = 0;
 
-		pthread_mutex_unlock(&m_mutex);
+		for (int i = 0; i < iovcnt; i++)
+		{
+			ssize_t r = m_spill->get(static_cast<char *>(iov[i].iov_base), iov[i].iov_len);
+			if (r == -1)
+				return false;
+			len += r;
+		}
+		m_buffer->commit(len);
+	}
+	return true;
+}
+
+/** Size of reads of data the reader waits for.
+**/
+static const size_t DemandSize = 64 * 1024;
+
+/** Device read of the prefetch thread.
+**/
+struct Fetch : public ReadQueue::Job
+{
+	/** Buffers of the request.
+	**/
+	struct iovec      buffers[2];
+
+	/** Buffer the data go to.
+	**/
+	CBuffer          *target;
+	size_t            len;
+
+	/** True if the read has size chosen by ChunkSize.
+	**/
+	bool              sample;
+
+	/** Bounce buffer used if target is not in memory.
+	**/
+	std::vector<char> buf;
+};
+
+/** Abort all reads in flight and wait for them, their data are
+ *  thrown away.
+**/
+static void drain(ReadQueue *queue, std::deque<Fetch *>& flight, std::vector<Fetch *>& idle)
+{
+	if (!flight.empty())
+		queue->abort();
+
+	while (!flight.empty())
+	{
+		queue->wait(flight.front());
+		idle.push_back(flight.front());
+		flight.pop_front();
+	}
+}
 
-		/** This read() may take a long time, thus we don't hold
-		 *  the mutex.
+void PreLoadFs::runBuffer(Device *dev, bool opened)
+{
+	/** Other threads get copies of the opened device, so the
+	 *  file is not opened again. Devices that can't be copied
+	 *  are opened by their threads. A stream is read by a single
+	 *  thread, an asynchronous device serves all reads alone.
+	**/
+	std::vector<Device *> devices(1, dev);
+	std::vector<Device *> closed;
+	size_t depth = (opened && (dev->sequential() || dev->asynchronous())) ? 1 : m_queue->depth();
+
+	for (size_t i = 1; i < depth; i++)
+	{
+		Device *copy = opened ? dev->clone() : NULL;
+		if (copy != NULL)
+			devices.push_back(copy);
+		else
+			closed.push_back(createDevice());
+	}
+
+	size_t openedDevices = opened ? devices.size() : 0;
+	devices.insert(devices.end(), closed.begin(), closed.end());
+
+	m_queue->start(devices, m_name.string(), openedDevices);
+
+	std::vector<Fetch> fetches(m_queue->depth());
+	std::vector<Fetch *> idle;
+	for (size_t i = 0; i < fetches.size(); i++)
+		idle.push_back(&fetches[i]);
+
+	/** Reads in flight in order of offset. Each has its own part
+	 *  of free space of its target, bytes of free space given to
+	 *  reads are counted for both buffers.
+	**/
+	std::deque<Fetch *> flight;
+	size_t assigned = 0;
+	size_t spillAssigned = 0;
+
+	/** Offset of the next read.
+	**/
+	off_t offset = 0;
+
+	/** End of file or error reached by device while data are
+	 *  still in the spill tier. Reader is told when they are
+	 *  promoted to the buffer.
+	**/
+	bool ended = false;
+	int endError = 0;
+
+	/** File offset following data in the spill tier.
+	**/
+	off_t spillEnd = 0;
+
+	/** Reads are issued in batches between the watermarks, bytes
+	 *  requested by the current batch.
+	**/
+	bool refill = true;
+	size_t batch = 0;
+
+	while (true)
+	{
+		/** Take the event first to not miss a wake-up.
 		**/
-		if (g_DebugMode)
-			std::cout << __PRETTY_FUNCTION__ << "..reading: " << readBytes << std::endl;
+		int event = m_buffer->spaceEvent();
 
-		int r = dev->pread(buf, readBytes, offset);
+		if (seekRequested())
+		{
+			/** Reads in flight write to free space of the
+			 *  buffer, they must finish before it is reused.
+			**/
+			drain(m_queue, flight, idle);
+			assigned = 0;
+			spillAssigned = 0;
+
+			offset = acceptSeek();
+			ended = false;
+			refill = true;
+			batch = 0;
+
+			/** Seek forward into spilled data skips to them, they
+			 *  are promoted to the buffer from there (data in the
+			 *  buffer are dropped by reader). Otherwise the spill
+			 *  tier is dropped too.
+			**/
+			if (m_spill != NULL)
+			{
+				off_t spillStart = spillEnd - m_spill->full();
+				if (!m_spill->isFree() && (offset >= spillStart) && (offset < spillEnd))
+				{
+					m_spill->drop(offset - spillStart);
+					offset = spillEnd;
+				}
+				else
+					m_spill->drop(m_spill->full());
+			}
+		}
 
-		if (g_DebugMode)
-			std::cout << __PRETTY_FUNCTION__ << "..read: " << r << std::endl;
+		/** Spill tier has data only if no read to the buffer is
+		 *  in flight, so promoted data don't collide with them.
+		**/
+		if (m_spill != NULL)
+		{
+			if (!promote())
+				setException(EIO);
 
-		pthread_mutex_lock(&m_mutex);
+			if (ended && m_spill->isFree())
+			{
+				ended = false;
+				setException(endError);
+			}
+		}
 
-		if (m_seeked == true)
+		/** A new batch starts once data drop below the low
+		 *  watermark or the reader waits for data.
+		**/
+		if (!refill && ((m_buffer->full() + assigned < m_buffer->lowWatermark()) || (missingDemand(assigned) > 0)))
+			refill = true;
+
+		/** Issue reads of consecutive offsets.
+		**/
+		while (refill && !idle.empty() && !ended && !exception())
 		{
+			size_t used = m_buffer->full() + assigned;
+			size_t missing = missingDemand(assigned);
+			bool high = (used >= m_highWatermark) && (missing == 0);
+
+			/** Data go to the spill tier once the buffer is full and
+			 *  until the spill tier is empty again to keep them in order.
+			**/
+			CBuffer *target = m_buffer;
+			size_t *targetAssigned = &assigned;
+			if ((m_spill != NULL) && (!m_spill->isFree() || (spillAssigned > 0) || (m_buffer->free() <= assigned) || high))
+			{
+				target = m_spill;
+				targetAssigned = &spillAssigned;
+			}
+
+			if ((target->free() <= *targetAssigned) || ((target == m_buffer) && high))
+			{
+				refill = false;
+				batch = 0;
+				break;
+			}
+
+			size_t chunk = m_chunk->size();
+
+			Fetch *fetch = idle.back();
+			idle.pop_back();
+
+			fetch->target = target;
+			fetch->offset = offset;
+			fetch->len = std::min(chunk, target->free() - *targetAssigned);
+			if ((target == m_buffer) && (missing == 0))
+				fetch->len = std::min(fetch->len, m_highWatermark - used);
+			fetch->sample = (fetch->len == chunk);
+
+			/** Data the reader waits for are fetched first by small
+			 *  reads that arrive quickly, readahead follows them.
+			**/
+			if ((target == m_buffer) && (missing > 0))
+			{
+				fetch->len = std::min(fetch->len, (missing + DemandSize - 1) / DemandSize * DemandSize);
+				fetch->sample = false;
+			}
+
+			if (batch == 0)
+				m_batches++;
+			batch += fetch->len;
+			m_batchBytes += fetch->len;
+
+			/** Free space of the buffer is not touched by reader,
+			 *  it is safe to fill it while reader is running. Read
+			 *  data directly into the buffer if its back storage
+			 *  is in memory, otherwise use a bounce buffer.
+			**/
+			if (target->address(0) != NULL)
+			{
+				fetch->iovcnt = target->writeVector(fetch->buffers, fetch->len, *targetAssigned);
+			}
+			else
+			{
+				if (fetch->buf.size() < fetch->len)
+					fetch->buf.resize(fetch->len);
+
+				fetch->buffers[0].iov_base = &fetch->buf[0];
+				fetch->buffers[0].iov_len = fetch->len;
+				fetch->iovcnt = 1;
+			}
+			fetch->iov = fetch->buffers;
+
 			if (g_DebugMode)
-				std::cout << __PRETTY_FUNCTION__ << "..seeked...continue" << std::endl;
+				std::cout << __PRETTY_FUNCTION__ << "..reading: " << fetch->len << " at " << offset << std::endl;
+
+			m_queue->submit(fetch);
+			flight.push_back(fetch);
+
+			offset += fetch->len;
+			*targetAssigned += fetch->len;
+		}
+
+		/** Wait until buffer is not full or exception is resolved.
+		 *  Spill tier gets space only when the buffer does.
+		**/
+		if (flight.empty())
+		{
+			if (g_DebugMode)
+				std::cout << __PRETTY_FUNCTION__ << ", isFull: " << m_buffer->isFull() <<
+			                                            ", exception: " << exception() << std::endl;
+
+			/** Reading is idle, record data fetched so far.
+			**/
+			if (m_diskCache != NULL)
+				m_diskCache->flush();
 
-			m_seeked = false;
-			offset = m_offset;
+			m_buffer->waitSpace(event);
+			m_wakeups++;
+			continue;
+		}
+
+		/** This wait may take a long time.
+		**/
+		Fetch *fetch = flight.front();
+		m_queue->wait(fetch);
+		flight.pop_front();
+		idle.push_back(fetch);
+
+		if (fetch->target == m_buffer)
+			assigned -= fetch->len;
+		else
+			spillAssigned -= fetch->len;
+
+		if (seekRequested())
+		{
+			if (g_DebugMode)
+				std::cout << __PRETTY_FUNCTION__ << "..seeked...continue" << std::endl;
 
 			/** User seeked before we stored data in the buffer,
 			 *  by continue we discard it and start again.
@@ -454,48 +1138,85 @@ void PreLoadFs::run()
 			continue;
 		}
 
-		if (r == -1)
+		ssize_t r = fetch->result;
+
+		/** Read aborted by a seek that has been accepted already,
+		 *  read it again.
+		**/
+		if ((r == -1) && (fetch->error == ECANCELED))
 		{
-			/** Error during read. Set exception flag and error
-			 *  type code.
-			**/
-			m_exception = true;
-			m_error = errno;
+			drain(m_queue, flight, idle);
+			assigned = 0;
+			spillAssigned = 0;
+
+			offset = fetch->offset;
+			continue;
 		}
-		else if (r == 0)
+
+		if (r <= 0)
 		{
-			/** End of file detected. Set exception flag and
-			 *  error type code set to zero.
+			/** Error during read or end of file detected (error
+			 *  type code set to zero). Set exception flag after
+			 *  data in the spill tier are passed to the reader.
 			**/
-			m_exception = true;
-			m_error = 0;
+			drain(m_queue, flight, idle);
+			assigned = 0;
+			spillAssigned = 0;
+
+			ended = true;
+			endError = (r == -1) ? fetch->error : 0;
+
+			if ((m_spill == NULL) || m_spill->isFree())
+			{
+				ended = false;
+				setException(endError);
+			}
+			continue;
 		}
+
+		/** Only complete reads of the current size tell
+		 *  something about the device.
+		**/
+		if (fetch->sample && (static_cast<size_t>(r) == fetch->len))
+			m_chunk->sample(fetch->len, fetch->seconds);
+
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << "..pushing" << std::endl;
+
+		/** Store data to the buffer. Reader is woken up
+		 *  by the buffer.
+		**/
+		ssize_t t = r;
+		if (fetch->target->address(0) != NULL)
+			fetch->target->commit(r);
 		else
-		{
-			offset += r;
+			t = fetch->target->put(&fetch->buf[0], r);
 
-			if (g_DebugMode)
-				std::cout << __PRETTY_FUNCTION__ << "..pushing" << std::endl;
+		if ((t != -1) && (fetch->target == m_spill))
+			spillEnd = fetch->offset + t;
 
-			/** Store data to the buffer.
+		if (t == -1)
+		{
+			/** Error during storing data to the buffer
+			 *  (most probably problem with backing file).
 			**/
-			int t = m_buffer.put(buf, r);
-			if (t == -1)
-			{
-				/** Error during storing data to the buffer
-				 *  (most probably problem with backing file).
-				**/
-				m_exception = true;
-				m_error = EIO;
-			}
-			else
-			{
-				assert(t == r);
-			}
+			setException(EIO);
+		}
+		else
+		{
+			assert(t == r);
 		}
-		/** Signal that there are new data available (or error).
+
+		/** Following reads don't continue where this one ended,
+		 *  read again from there.
 		**/
-		pthread_cond_signal(&m_wakeupNewData);
+		if (static_cast<size_t>(r) < fetch->len)
+		{
+			drain(m_queue, flight, idle);
+			assigned = 0;
+			spillAssigned = 0;
+
+			offset = fetch->offset + r;
+		}
 	}
 }
-
@@ -2,17 +2,86 @@
 #define PRELOADFS_HPP
 
 #include "MBuffer.hpp"
+#include "Device.hpp"
+#include "BlockCache.hpp"
+#include "ChunkSize.hpp"
+#include "ReadQueue.hpp"
 #include <fuse.h>
 #include <pthread.h>
 #include <boost/filesystem.hpp>
 
+class DiskCache;
+
 class PreLoadFs
 {
 public:
+	/** How data are cached.
+	**/
+	enum Mode
+	{
+		/** Circular buffer in front of a single sequential reader.
+		**/
+		ModeRing,
+
+		/** Blocks of the file keyed by offset, for random access.
+		**/
+		ModeBlocks
+	};
+
+	/** Configuration.
+	**/
+	struct Options
+	{
+		Options();
+
+		/** Temporary file storage path
+		**/
+		std::string    tmpPath;
+
+		/** Size of the buffer (cache) in bytes
+		**/
+		size_t         bufferSize;
+
+		MBuffer::Pages pages;
+
+		/** Size of look-behind window of the buffer in bytes
+		**/
+		size_t         lookBehind;
+
+		Mode           mode;
+
+		/** Size of a block in ModeBlocks in bytes
+		**/
+		size_t         blockSize;
+
+		/** Keep data fetched over HTTP in tmpPath across mounts
+		**/
+		bool           persistent;
+
+		/** Size of file backed tier in front of the buffer in
+		 *  bytes (0 if not used). Stored in tmpPath.
+		**/
+		size_t         spillSize;
+
+		/** Number of device reads in flight in ModeRing
+		**/
+		size_t         depth;
+
+		/** Reading starts again when data in the buffer drop below
+		 *  the low watermark and fills it up to the high watermark
+		 *  in bytes (0 for the size of the buffer).
+		**/
+		size_t         lowWatermark;
+		size_t         highWatermark;
+
+		Device::Options device;
+	};
+
 	/** Constructor.
-	 *  @param tmpPath temporary file storage path
+	 *  @param options configuration
+	 *  @param fileToMount file to pre-load
 	 **/
-	PreLoadFs(const std::string& tmpPath, size_t tmpSize, const std::string& fileToMount);
+	PreLoadFs(const Options& options, const std::string& fileToMount);
 	~PreLoadFs();
 
 	void *init();
@@ -25,6 +94,9 @@ public:
 	int release(const char *name, struct fuse_file_info *fi);
 	int read(const char *name, char *buf, size_t len, off_t offset, struct fuse_file_info *fi);
 	int write(const char *name, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi);
+#if FUSE_USE_VERSION >= 29
+	int readBuf(const char *name, struct fuse_bufvec **bufp, size_t len, off_t offset, struct fuse_file_info *fi);
+#endif
 
 private:
 	int stat(char *buf, size_t len);
@@ -39,12 +111,82 @@ private:
 	**/
 	void run();
 
+	/** Create device for the mounted file.
+	**/
+	Device *createDevice();
+
+	/** Pre-load data into the circular buffer (ModeRing).
+	 *  @param dev device, used by the first reading thread
+	 *  @param opened true if dev is opened already
+	**/
+	void runBuffer(Device *dev, bool opened);
+
+	/** Move data from the spill tier to the buffer as long as
+	 *  there is free space and no seek is requested.
+	 *  @return false on error
+	**/
+	bool promote();
+
+	/** Fetch blocks requested by the cache (ModeBlocks).
+	**/
+	void runCache(Device *dev);
+
+	/** Request the thread to continue reading from a new offset
+	 *  unless data for the offset are already in the buffer.
+	**/
 	void seek(off_t offset);
 
+	/** Check whether the thread accepted offset requested by
+	 *  seek() and drop data stored for the old offset if so.
+	 *  @return true if there is no seek pending
+	**/
+	bool seekDone();
+
+	/** Wait until at least len bytes are in the buffer or an
+	 *  exception is detected. Demand announced by demand() is
+	 *  withdrawn then.
+	**/
+	void waitData(size_t len);
+
+	/** Announce that the reader needs len bytes at the read
+	 *  position, the thread fetches them before readahead.
+	**/
+	void demand(size_t len);
+
+	/** Used by thread. Return number of bytes the reader needs that
+	 *  are neither in the buffer nor assigned to reads in flight.
+	 *  @param assigned bytes of the buffer assigned to reads
+	**/
+	size_t missingDemand(size_t assigned) const;
+
+	/** Release data handed over to FUSE by readBuf().
+	**/
+	void unpin();
+
+	/** Return true if error or end of file has been detected.
+	**/
+	bool exception() const;
+
+	/** Set exception with error code and wake-up reader.
+	**/
+	void setException(int error);
+
+	/** Used by thread. Return true if user requested seek
+	 *  that has not been accepted yet.
+	**/
+	bool seekRequested() const;
+
+	/** Used by thread. Accept offset requested by seek().
+	 *  @return new offset to read from
+	**/
+	off_t acceptSeek();
+
 	/** Name of pre-loaded (mounted) file.
 	**/
 	boost::filesystem::path m_name;
 
+	Device::Options m_deviceOptions;
+
 	/** Reference counter
 	**/
 	int             m_refs;
@@ -54,30 +196,43 @@ private:
 	 **/
 	off_t           m_offset;
 
-	/** Buffer.
+	/** Buffer, NULL in ModeBlocks.
 	**/
-	MBuffer         m_buffer;
+	CBuffer        *m_buffer;
 
-	/** Thread used to pre-read content of the file.
+	/** Size of device reads in ModeRing, NULL in ModeBlocks.
 	**/
-	pthread_t       m_thread;
+	ChunkSize      *m_chunk;
 
-	/** Condition variable used to wake-up thread to let it
-	 *  continue to read new data.
-	 **/
-	pthread_cond_t  m_wakeupReadNewData;
+	/** Threads reading from devices in ModeRing, NULL in ModeBlocks.
+	**/
+	ReadQueue      *m_queue;
 
-	/** Confition variable used to signal that new data
-	 *  has been read.
-	 **/
-	pthread_cond_t  m_wakeupNewData;
+	/** File backed tier filled ahead of the buffer, NULL if not
+	 *  used. Used only by the thread.
+	**/
+	CBuffer        *m_spill;
+
+	/** Block cache, NULL in ModeRing.
+	**/
+	BlockCache     *m_cache;
+
+	/** Thread used to pre-read content of the file.
+	**/
+	pthread_t       m_thread;
 
 	pthread_cond_t	m_wakeupStatAvailable;
 
 	/** Mutex that protects every variables shared with thread.
+	 *  Buffer itself is lock-free and not protected by it.
 	**/
 	pthread_mutex_t m_mutex;
 
+	/** Mutex that serializes FUSE requests using the buffer,
+	 *  buffer supports a single reader only.
+	**/
+	pthread_mutex_t m_readMutex;
+
 	/** True if error or end of file has been detected
 	 *  during read.
 	**/
@@ -89,12 +244,50 @@ private:
 	 **/
 	int             m_error;
 
-	/** True if user seeked. Set only in read() and
-	 *  cleared only in run().
-	 **/
-	bool            m_seeked;
+	/** Seek requests counter. Incremented by seek(), the thread
+	 *  sets m_seekDone to it when it accepted new offset
+	 *  (m_seekOffset) and m_seekMark to the buffer's write
+	 *  position where data for the new offset start.
+	**/
+	int             m_seekRequest;
+	int             m_seekDone;
+	off_t           m_seekOffset;
+	uint64_t        m_seekMark;
+
+	/** True if seek has been requested and not accepted by the
+	 *  thread yet. Used only by reader.
+	**/
+	bool            m_seekPending;
 
 	off_t		m_size;
+
+	/** Persistent cache, NULL if not used.
+	**/
+	DiskCache      *m_diskCache;
+
+	/** Number of bytes the reader needs at the read position, 0 if
+	 *  it doesn't wait. Set by reader, used by thread.
+	**/
+	size_t          m_demand;
+
+	/** Number of bytes at the read pointer that were handed
+	 *  over to FUSE by readBuf() and are not consumed yet.
+	 *  They stay in the buffer until the next request.
+	**/
+	size_t          m_pinned;
+
+	/** Thread stops reading to the buffer when data in it and
+	 *  reads in flight to it reach this many bytes.
+	**/
+	size_t          m_highWatermark;
+
+	/** Statistics of the thread: number of its wake-ups while
+	 *  waiting for space, number of batches of reads and bytes
+	 *  requested by them.
+	**/
+	size_t          m_wakeups;
+	size_t          m_batches;
+	size_t          m_batchBytes;
 };
 
 #endif
@@ -0,0 +1,209 @@
+#include "ReadQueue.hpp"
+#include "Device.hpp"
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <algorithm>
+
+extern bool g_DebugMode;
+
+ReadQueue::ReadQueue(size_t depth) :
+	m_workers(depth),
+	m_depth(depth),
+	m_device(NULL),
+	m_started(false),
+	m_inFlight(0)
+{
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_jobAvailable, NULL);
+	pthread_cond_init(&m_jobDone, NULL);
+}
+
+ReadQueue::~ReadQueue()
+{
+	/** Threads are not stopped, they are expected to run
+	 *  until the whole application ends.
+	**/
+	pthread_cond_destroy(&m_jobDone);
+	pthread_cond_destroy(&m_jobAvailable);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void ReadQueue::start(const std::vector<Device *>& devices, const std::string& name, size_t opened)
+{
+	m_name = name;
+
+	if ((opened > 0) && devices[0]->asynchronous())
+	{
+		m_device = devices[0];
+		m_workers.clear();
+
+		for (size_t i = 1; i < devices.size(); i++)
+			delete devices[i];
+
+		__atomic_store_n(&m_started, true, __ATOMIC_RELEASE);
+		return;
+	}
+
+	m_workers.resize(std::min(m_workers.size(), devices.size()));
+	m_depth = m_workers.size();
+
+	for (size_t i = 0; i < m_workers.size(); i++)
+	{
+		m_workers[i].queue = this;
+		m_workers[i].device = devices[i];
+		m_workers[i].opened = (i < opened);
+
+		pthread_create(&m_workers[i].thread, NULL, runT, &m_workers[i]);
+	}
+
+	__atomic_store_n(&m_started, true, __ATOMIC_RELEASE);
+}
+
+/** Return monotonic time in seconds.
+**/
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void ReadQueue::submit(Job *job)
+{
+	job->done = false;
+
+	if (m_device != NULL)
+	{
+		/** Duration is counted from submission.
+		**/
+		job->seconds = now();
+		m_device->submit(job);
+		__atomic_store_n(&m_inFlight, m_inFlight + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	m_pending.push_back(job);
+	__atomic_store_n(&m_inFlight, m_inFlight + 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&m_jobAvailable);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void ReadQueue::wait(Job *job)
+{
+	while ((m_device != NULL) && !job->done)
+	{
+		Job *done = static_cast<Job *>(m_device->complete(true));
+		if (done == NULL)
+		{
+			/** Device failed, its requests are lost.
+			**/
+			done = job;
+			done->result = -1;
+			done->error = errno;
+		}
+
+		done->seconds = now() - done->seconds;
+		done->done = true;
+		__atomic_store_n(&m_inFlight, m_inFlight - 1, __ATOMIC_RELAXED);
+
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", offset: " << done->offset << ", read: " << done->result << std::endl;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	while (!job->done)
+		pthread_cond_wait(&m_jobDone, &m_mutex);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void ReadQueue::abort()
+{
+	if (!__atomic_load_n(&m_started, __ATOMIC_ACQUIRE))
+		return;
+
+	if (m_device != NULL)
+	{
+		m_device->cancel();
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	while (!m_pending.empty())
+	{
+		Job *job = m_pending.front();
+		m_pending.pop_front();
+
+		job->result = -1;
+		job->error = ECANCELED;
+		job->seconds = 0;
+		job->done = true;
+		__atomic_store_n(&m_inFlight, m_inFlight - 1, __ATOMIC_RELAXED);
+	}
+	pthread_cond_broadcast(&m_jobDone);
+	pthread_mutex_unlock(&m_mutex);
+
+	for (size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i].device->cancel();
+}
+
+size_t ReadQueue::depth() const
+{
+	return m_depth;
+}
+
+size_t ReadQueue::inFlight() const
+{
+	return __atomic_load_n(&m_inFlight, __ATOMIC_RELAXED);
+}
+
+void *ReadQueue::runT(void *arg)
+{
+	Worker *worker = reinterpret_cast<Worker*>(arg);
+	worker->queue->run(worker);
+
+	/** Function run() is expected to never return...
+	**/
+	return NULL;
+}
+
+void ReadQueue::run(Worker *worker)
+{
+	while (true)
+	{
+		pthread_mutex_lock(&m_mutex);
+		while (m_pending.empty())
+			pthread_cond_wait(&m_jobAvailable, &m_mutex);
+
+		Job *job = m_pending.front();
+		m_pending.pop_front();
+
+		pthread_mutex_unlock(&m_mutex);
+
+		/** Device is opened on the first use, failed open is
+		 *  reported as failed read and tried again next time.
+		**/
+		if (!worker->opened)
+			worker->opened = worker->device->open(m_name.c_str());
+
+		double start = now();
+
+		if (worker->opened)
+			job->result = worker->device->preadv(job->iov, job->iovcnt, job->offset);
+		else
+			job->result = -1;
+		job->error = errno;
+
+		job->seconds = now() - start;
+
+		if (g_DebugMode)
+			std::cout << __PRETTY_FUNCTION__ << ", offset: " << job->offset << ", read: " << job->result << std::endl;
+
+		pthread_mutex_lock(&m_mutex);
+		job->done = true;
+		__atomic_store_n(&m_inFlight, m_inFlight - 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&m_jobDone);
+		pthread_mutex_unlock(&m_mutex);
+	}
+}
@@ -0,0 +1,120 @@
+#ifndef READQUEUE_HPP
+#define READQUEUE_HPP
+
+#include "Device.hpp"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+/** Pool of threads reading from a file, each of them uses its own
+ *  device. Jobs submitted by a single thread are served in order
+ *  of submission by the first free thread, so several reads of
+ *  consecutive offsets are in flight at once. A device that keeps
+ *  reads in flight by itself (Device::asynchronous()) is driven
+ *  by the submitting thread instead, no threads are started.
+**/
+class ReadQueue
+{
+public:
+	/** Read request, offset and buffers of the request are set by
+	 *  the submitter.
+	**/
+	struct Job : public Device::Request
+	{
+		/** Duration of the read in seconds.
+		**/
+		double       seconds;
+
+		bool         done;
+	};
+
+	/** Constructor.
+	 *  @param depth number of threads (reads in flight)
+	**/
+	ReadQueue(size_t depth);
+	~ReadQueue();
+
+	/** Start threads.
+	 *  @param devices device for each thread (at most depth of them,
+	 *  fewer threads are started if there are fewer devices), owned
+	 *  by this object; devices that are not opened yet are opened
+	 *  by their thread
+	 *  @param name name of the file to open
+	 *  @param opened number of devices at the beginning of the vector
+	 *  that are opened already; if the first one is opened and
+	 *  asynchronous, it is used alone
+	**/
+	void start(const std::vector<Device *>& devices, const std::string& name, size_t opened);
+
+	/** Queue a job, one of threads reads it.
+	**/
+	void submit(Job *job);
+
+	/** Block until job is done. Jobs of an asynchronous device
+	 *  complete while waiting.
+	**/
+	void wait(Job *job);
+
+	/** Abort jobs in flight, they fail with ECANCELED (or read
+	 *  partially). Jobs not taken by a thread fail at once, devices
+	 *  are asked to interrupt reads in progress. May be called by
+	 *  any thread.
+	**/
+	void abort();
+
+	/** Return number of threads.
+	**/
+	size_t depth() const;
+
+	/** Return number of jobs submitted and not done yet.
+	**/
+	size_t inFlight() const;
+
+private:
+	struct Worker
+	{
+		ReadQueue  *queue;
+		Device     *device;
+		bool        opened;
+		pthread_t   thread;
+	};
+
+	/** "Trampoline" function just to execute run() in
+	 *  correct context.
+	**/
+	static void *runT(void *arg);
+
+	/** Thread function, reads jobs from the queue.
+	**/
+	void run(Worker *worker);
+
+	std::vector<Worker> m_workers;
+	std::string         m_name;
+
+	/** Number of jobs in flight.
+	**/
+	size_t              m_depth;
+
+	/** Asynchronous device, NULL if jobs are read by threads.
+	**/
+	Device             *m_device;
+
+	/** True once start() has set up the devices.
+	**/
+	bool                m_started;
+
+	/** Jobs not taken by a thread yet.
+	**/
+	std::deque<Job *>   m_pending;
+
+	size_t              m_inFlight;
+
+	pthread_mutex_t     m_mutex;
+	pthread_cond_t      m_jobAvailable;
+	pthread_cond_t      m_jobDone;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "config.h"
+#include "Uring.hpp"
+#include <stddef.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+
+Uring::Uring() :
+	m_fd(-1),
+	m_entries(0),
+	m_queued(0),
+	m_sq(MAP_FAILED),
+	m_sqSize(0),
+	m_cq(MAP_FAILED),
+	m_cqSize(0),
+	m_sqes(NULL),
+	m_sqesSize(0)
+{
+}
+
+Uring::~Uring()
+{
+	if (m_sqes != NULL)
+		munmap(m_sqes, m_sqesSize);
+	if ((m_cq != MAP_FAILED) && (m_cq != m_sq))
+		munmap(m_cq, m_cqSize);
+	if (m_sq != MAP_FAILED)
+		munmap(m_sq, m_sqSize);
+	if (m_fd != -1)
+		close(m_fd);
+}
+
+bool Uring::init(unsigned depth)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	m_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (m_fd == -1)
+		return false;
+
+	m_entries = p.sq_entries;
+
+	/** Both rings may be mapped at once.
+	**/
+	m_sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+
+	m_sq = mmap(NULL, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sq == MAP_FAILED)
+		return false;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		m_cq = m_sq;
+	else
+		m_cq = mmap(NULL, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	if (m_cq == MAP_FAILED)
+		return false;
+
+	m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+	char *sq = static_cast<char *>(m_sq);
+	m_sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+	m_sqMask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+
+	char *cq = static_cast<char *>(m_cq);
+	m_cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+	m_cqMask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+	return true;
+}
+
+bool Uring::registerBuffers(const struct iovec *iov, unsigned count)
+{
+	return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+struct io_uring_sqe *Uring::entry()
+{
+	/** Kernel moves head, only this thread moves tail.
+	**/
+	unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *m_sqTail;
+
+	if (tail - head >= m_entries)
+		return NULL;
+
+	unsigned index = tail & *m_sqMask;
+	struct io_uring_sqe *sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqArray[index] = index;
+	return sqe;
+}
+
+bool Uring::readv(int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t tag)
+{
+	struct io_uring_sqe *sqe = entry();
+	if (sqe == NULL)
+		return false;
+
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(iov);
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = tag;
+
+	__atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+	return true;
+}
+
+bool Uring::readFixed(int fd, void *buf, size_t len, off_t offset, unsigned index, uint64_t tag)
+{
+	struct io_uring_sqe *sqe = entry();
+	if (sqe == NULL)
+		return false;
+
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(buf);
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = index;
+	sqe->user_data = tag;
+
+	__atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+	return true;
+}
+
+bool Uring::cancel(uint64_t target, uint64_t tag)
+{
+	struct io_uring_sqe *sqe = entry();
+	if (sqe == NULL)
+		return false;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = tag;
+
+	__atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+	return true;
+}
+
+bool Uring::submit(unsigned wait)
+{
+	while (true)
+	{
+		int r = syscall(__NR_io_uring_enter, m_fd, m_queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r >= 0)
+		{
+			m_queued -= std::min<unsigned>(r, m_queued);
+			return true;
+		}
+		/** Kernel may be short of resources for a moment.
+		**/
+		if ((errno == EAGAIN) || (errno == EBUSY))
+			usleep(100);
+		else if (errno != EINTR)
+			return false;
+	}
+}
+
+bool Uring::complete(uint64_t& tag, int& result)
+{
+	/** Kernel moves tail, only this thread moves head.
+	**/
+	unsigned head = *m_cqHead;
+	unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return false;
+
+	struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+	tag = cqe->user_data;
+	result = cqe->res;
+
+	__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#else
+
+/** Kernel headers have no io_uring, init() fails and devices
+ *  read by plain reads.
+**/
+Uring::Uring() :
+	m_fd(-1),
+	m_entries(0),
+	m_queued(0),
+	m_sq(NULL),
+	m_sqSize(0),
+	m_cq(NULL),
+	m_cqSize(0),
+	m_sqes(NULL),
+	m_sqesSize(0)
+{
+}
+
+Uring::~Uring()
+{
+}
+
+bool Uring::init(unsigned /*depth*/)
+{
+	errno = ENOSYS;
+	return false;
+}
+
+bool Uring::registerBuffers(const struct iovec * /*iov*/, unsigned /*count*/)
+{
+	return false;
+}
+
+bool Uring::readv(int /*fd*/, const struct iovec * /*iov*/, int /*iovcnt*/, off_t /*offset*/, uint64_t /*tag*/)
+{
+	return false;
+}
+
+bool Uring::readFixed(int /*fd*/, void * /*buf*/, size_t /*len*/, off_t /*offset*/, unsigned /*index*/, uint64_t /*tag*/)
+{
+	return false;
+}
+
+bool Uring::cancel(uint64_t /*target*/, uint64_t /*tag*/)
+{
+	return false;
+}
+
+bool Uring::submit(unsigned /*wait*/)
+{
+	errno = ENOSYS;
+	return false;
+}
+
+bool Uring::complete(uint64_t& /*tag*/, int& /*result*/)
+{
+	return false;
+}
+
+#endif
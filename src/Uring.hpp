@@ -0,0 +1,97 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/** Minimal io_uring instance for reads, set up by system calls
+ *  directly (liburing is not required). Used by a single thread.
+**/
+class Uring
+{
+public:
+	Uring();
+	~Uring();
+
+	/** Set up rings for depth requests.
+	 *  @return false if io_uring is not available
+	**/
+	bool init(unsigned depth);
+
+	/** Register buffers read by readFixed().
+	 *  @return false on error (e.g. locked memory limit)
+	**/
+	bool registerBuffers(const struct iovec *iov, unsigned count);
+
+	/** Queue a read to buffers (like preadv(2)). Requests are
+	 *  identified by tag in completions.
+	 *  @return false if the submission queue is full
+	**/
+	bool readv(int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t tag);
+
+	/** Queue a read to registered buffer index.
+	 *  @return false if the submission queue is full
+	**/
+	bool readFixed(int fd, void *buf, size_t len, off_t offset, unsigned index, uint64_t tag);
+
+	/** Queue cancellation of the request with tag target, it
+	 *  completes with -ECANCELED unless it is done already.
+	 *  Completion of the cancellation itself has tag.
+	 *  @return false if the submission queue is full
+	**/
+	bool cancel(uint64_t target, uint64_t tag);
+
+	/** Submit queued requests and wait for at least wait of them
+	 *  to complete.
+	 *  @return false on error (errno is set), requests are not
+	 *  submitted then
+	**/
+	bool submit(unsigned wait);
+
+	/** Take a completion.
+	 *  @param tag tag of the request
+	 *  @param result number of bytes read or -errno
+	 *  @return false if there is none
+	**/
+	bool complete(uint64_t& tag, int& result);
+
+	/** Number of requests that can be in flight.
+	**/
+	unsigned depth() const { return m_entries; }
+
+private:
+	/** Take a free submission queue entry, NULL if queue is full.
+	**/
+	struct io_uring_sqe *entry();
+
+	int      m_fd;
+	unsigned m_entries;
+
+	/** Requests queued and not submitted yet.
+	**/
+	unsigned m_queued;
+
+	void    *m_sq;
+	size_t   m_sqSize;
+	void    *m_cq;
+	size_t   m_cqSize;
+
+	struct io_uring_sqe *m_sqes;
+	size_t   m_sqesSize;
+
+	unsigned *m_sqHead;
+	unsigned *m_sqTail;
+	unsigned *m_sqMask;
+	unsigned *m_sqArray;
+
+	unsigned *m_cqHead;
+	unsigned *m_cqTail;
+	unsigned *m_cqMask;
+	struct io_uring_cqe *m_cqes;
+};
+
+#endif
@@ -14,6 +14,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #include <boost/program_options.hpp>
 
@@ -30,10 +31,22 @@ void print_license()
 	printf("warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\n");
 }
 
+#if FUSE_USE_VERSION >= 26
+void *Init(struct fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_SPLICE_WRITE
+	/** Let FUSE splice buffer's pages handed over by ReadBuf().
+	**/
+	conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+#endif
+	return g_PreLoadFs->init();
+}
+#else
 void *Init()
 {
 	return g_PreLoadFs->init();
 }
+#endif
 
 void Destroy(void *arg)
 {
@@ -70,9 +83,16 @@ int Write(const char *name, const char *buf, size_t len, off_t offset, struct fu
 	return g_PreLoadFs->write(name, buf, len, offset, fi);
 }
 
-int run(std::vector<const char *>& fuse_c_str, const std::string& fileToMount, const std::string& tmpPath, int bufSize)
+#if FUSE_USE_VERSION >= 29
+int ReadBuf(const char *name, struct fuse_bufvec **bufp, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+	return g_PreLoadFs->readBuf(name, bufp, len, offset, fi);
+}
+#endif
+
+int run(std::vector<const char *>& fuse_c_str, const std::string& fileToMount, const PreLoadFs::Options& options, bool singleThreaded)
 {
-	g_PreLoadFs = new PreLoadFs(tmpPath, bufSize, fileToMount);
+	g_PreLoadFs = new PreLoadFs(options, fileToMount);
 	if (g_PreLoadFs == NULL)
 	{
 		std::cerr << "Failed to create an instance of PreLoadFs" << std::endl;
@@ -90,8 +110,21 @@ int run(std::vector<const char *>& fuse_c_str, const std::string& fileToMount, c
 	ops.read = Read;
 	ops.write = Write;
 	ops.release = Release;
- 
+#if FUSE_USE_VERSION >= 29
+	/** Data handed over by read_buf stay in the buffer only until
+	 *  the next request, it must not be served by another thread
+	 *  while the reply is being written. Multi-threaded FUSE copies
+	 *  data by read.
+	**/
+	if (singleThreaded)
+		ops.read_buf = ReadBuf;
+#endif
+
+#if FUSE_USE_VERSION >= 26
+	return fuse_main(fuse_c_str.size(), const_cast<char**>(&fuse_c_str[0]), &ops, NULL);
+#else
 	return fuse_main(fuse_c_str.size(), const_cast<char**>(&fuse_c_str[0]), &ops);
+#endif
 }
 
 int main(int argc, char **argv)
@@ -100,15 +133,40 @@ int main(int argc, char **argv)
 
 	std::string fileToMount;
 	std::string mountPoint;
-	std::string tmpPath = "/tmp";
-	int bufSize = 128;
+	PreLoadFs::Options options;
+	size_t bufSize = 128;
+	size_t lookBehind = 0;
+	size_t lowWatermark = 0;
+	size_t highWatermark = 0;
+	size_t blockSize = 256;
+	bool singleThreaded = false;
+	size_t spillSize = 0;
+	size_t depth = 1;
+	std::string hugePages = "none";
+	std::string mode = "ring";
 
 	po::options_description desc("Usage: " PACKAGE " [options] fileToMount mountPath\n" "\nOptions");
 	desc.add_options()
 		("fileToMount", po::value<std::string>(&fileToMount), "file to mount (local file or HTTP URL)")
 		("mountPoint", po::value<std::string>(&mountPoint), "mount point")
-		("tmp,t", po::value<std::string>(&tmpPath), "temporary path for a buffer")
-		("buffer,b", po::value<int>(&bufSize), "buffer size in KiB")
+		("tmp,t", po::value<std::string>(&options.tmpPath), "temporary path for a buffer")
+		("buffer,b", po::value<size_t>(&bufSize), "buffer size in KiB")
+		("hugepages", po::value<std::string>(&hugePages), "huge pages for a buffer (none, transparent, explicit)")
+		("lookbehind,l", po::value<size_t>(&lookBehind), "already read data kept in a buffer in KiB")
+		("low", po::value<size_t>(&lowWatermark), "refill a buffer when data in it drop below this in KiB")
+		("high", po::value<size_t>(&highWatermark), "refill a buffer up to this in KiB")
+		("mode,m", po::value<std::string>(&mode), "caching mode (ring for sequential, blocks for random access)")
+		("blocksize", po::value<size_t>(&blockSize), "block size in KiB for blocks mode")
+		("persistent,p", "keep data fetched over HTTP in temporary path across mounts")
+		("spill,s", po::value<size_t>(&spillSize), "size of file backed tier in temporary path in KiB")
+		("queue,q", po::value<size_t>(&depth), "number of device reads in flight")
+		("connections,c", po::value<size_t>(&options.device.connections), "number of HTTP connections per device read")
+		("pipeline", po::value<size_t>(&options.device.pipeline), "number of HTTP requests queued on a connection")
+		("retries", po::value<size_t>(&options.device.retries), "number of HTTP retries of a read that receive no data")
+		("mirror", po::value<std::vector<std::string> >(&options.device.mirrors), "URL of a mirror of the file (may be repeated)")
+		("iodepth", po::value<size_t>(&options.device.iodepth), "number of reads of a local file in flight (io_uring, 0 for plain reads)")
+		("direct", "read a local file bypassing page cache (O_DIRECT, with iodepth)")
+		("single,S", "serve requests by a single thread (reads are spliced from the buffer)")
 		("debug,d", "turn on debug mode")
 		("help,h", "print this help")
 		("version,v", "print version")
@@ -141,6 +199,45 @@ int main(int argc, char **argv)
 	{
 		g_DebugMode = true;
 	}
+	if (vm.count("persistent"))
+	{
+		options.persistent = true;
+	}
+	if (vm.count("direct"))
+	{
+		options.device.direct = true;
+	}
+	if (vm.count("single"))
+	{
+		singleThreaded = true;
+	}
+	if (hugePages == "transparent")
+	{
+		options.pages = MBuffer::PagesTransparent;
+	}
+	else if (hugePages == "explicit")
+	{
+		options.pages = MBuffer::PagesHuge;
+	}
+	else if (hugePages != "none")
+	{
+		std::cout << "Unknown hugepages mode!\n" << desc;
+		exit(EXIT_FAILURE);
+	}
+	if (mode == "blocks")
+	{
+		options.mode = PreLoadFs::ModeBlocks;
+	}
+	else if (mode != "ring")
+	{
+		std::cout << "Unknown mode!\n" << desc;
+		exit(EXIT_FAILURE);
+	}
+	if ((blockSize == 0) || (bufSize == 0) || (depth == 0) || (options.device.connections == 0))
+	{
+		std::cout << "Buffer size, block size, queue depth and connections must not be zero!\n" << desc;
+		exit(EXIT_FAILURE);
+	}
 	if (fileToMount.empty())
 	{
 		std::cout << "fileToMount not set!\n" << desc;
@@ -156,12 +253,28 @@ int main(int argc, char **argv)
 
 	if (g_DebugMode)
 		fuse_c_str.push_back("-f");
+	if (singleThreaded)
+		fuse_c_str.push_back("-s");
 	fuse_c_str.push_back("-o");
 	fuse_c_str.push_back("default_permissions,use_ino");
 	fuse_c_str.push_back(mountPoint.c_str());
 
 	chdir(mountPoint.c_str());
 
-	return run(fuse_c_str, fileToMount, tmpPath, bufSize * 1024);
+	options.bufferSize = bufSize * 1024;
+	options.lookBehind = lookBehind * 1024;
+	options.lowWatermark = lowWatermark * 1024;
+	options.highWatermark = highWatermark * 1024;
+	options.blockSize = blockSize * 1024;
+	options.spillSize = spillSize * 1024;
+	options.depth = depth;
+
+	/** Reads in flight are spread over mirrors, have at least one
+	 *  for each of them unless set explicitly.
+	**/
+	if (!vm.count("queue"))
+		options.depth = std::max(depth, options.device.mirrors.size() + 1);
+
+	return run(fuse_c_str, fileToMount, options, singleThreaded);
 }
 